@@ -0,0 +1,368 @@
+// Benchmark driver for msh, see `make bench`
+//
+//     bench [-n commands] shell...
+//
+// Every shell is put through the same workloads and the results come out on
+// stdout as one JSON object, so runs can be kept and compared. For each
+// workload there is
+//
+//   - a throughput run: the whole workload as a script file, timed from
+//     spawn to exit. This gives commands/sec and the shell's peak RSS
+//   - a latency run: the commands fed one at a time over a pipe, each one
+//     followed by a bare `echo` so we can tell when it is done. p50/p99 are
+//     of that round trip, so they include one echo and two pipe hops
+//
+// Startup time is `shell -c true`, spawn to exit, over many runs.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define DEFAULT_COMMANDS 100000
+#define LATENCY_SAMPLES 2000
+#define STARTUP_RUNS 200
+#define CD_DEPTH 64
+#define LONG_ARGS 2000
+
+extern char **environ;
+
+char workdir[] = "/tmp/msh-bench-XXXXXX";
+char *deep_dir = NULL;
+
+struct workload
+{
+    const char *name;
+    const char *desc;
+    size_t divisor;          // Runs commands / divisor lines
+    const char *(*line)(size_t i);
+};
+
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* Workloads */
+
+const char *line_true(size_t i)
+{
+    return "true";
+}
+
+// Back and forth between the top and the bottom of a deep tree
+const char *line_cd(size_t i)
+{
+    static char *top = NULL;
+    if (top == NULL && asprintf(&top, "cd %s", workdir) == -1)
+        die("asprintf");
+    return i % 2 ? top : deep_dir;
+}
+
+const char *line_args(size_t i)
+{
+    static char *line = NULL;
+    if (line != NULL)
+        return line;
+
+    size_t len = 0;
+    FILE *f = open_memstream(&line, &len);
+    if (f == NULL)
+        die("open_memstream");
+    fputs("true", f);
+    for (int a = 0; a < LONG_ARGS; ++a)
+        fprintf(f, " argument%d", a);
+    fclose(f);
+    return line;
+}
+
+// A real external command, so this is the one that tells the engines apart
+const char *line_spawn(size_t i)
+{
+    return "/bin/true";
+}
+
+struct workload workloads[] = {
+    {"true", "builtin true", 1, line_true},
+    {"cd", "cd to the bottom of a deep tree and back", 1, line_cd},
+    {"args", "true with 2000 arguments", 100, line_args},
+    {"spawn", "/bin/true", 50, line_spawn},
+};
+
+void make_deep_dir()
+{
+    if (mkdtemp(workdir) == NULL)
+        die("mkdtemp");
+
+    size_t len = strlen(workdir) + CD_DEPTH * 2 + 4;
+    char *path = malloc(len);
+    if (path == NULL)
+        die("malloc");
+    strcpy(path, workdir);
+
+    for (int i = 0; i < CD_DEPTH; ++i)
+    {
+        strcat(path, "/d");
+        if (mkdir(path, 0700) == -1)
+            die(path);
+    }
+
+    if (asprintf(&deep_dir, "cd %s", path) == -1)
+        die("asprintf");
+    free(path);
+}
+
+void remove_deep_dir()
+{
+    char *path = strdup(deep_dir + 3);
+    for (int i = 0; i < CD_DEPTH; ++i)
+    {
+        rmdir(path);
+        *strrchr(path, '/') = '\0';
+    }
+    free(path);
+
+    char script[sizeof(workdir) + 16];
+    snprintf(script, sizeof(script), "%s/script", workdir);
+    unlink(script);
+    rmdir(workdir);
+}
+
+/* Running shells */
+
+// Spawn `argv` with stdin and stdout as given (or left alone if -1), wait
+// for it and hand back how long it took and its peak RSS
+long long run(char **argv, int in, int out, long *maxrss_kb)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in != -1)
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    if (out != -1)
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+
+    pid_t pid;
+    long long start = now_ns();
+    int err = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+    {
+        errno = err;
+        die(argv[0]);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1)
+        die("wait4");
+    long long elapsed = now_ns() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "bench: %s exited with status %d\n", argv[0], status);
+
+    if (maxrss_kb != NULL)
+        *maxrss_kb = ru.ru_maxrss;
+    return elapsed;
+}
+
+int compare_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted samples, in microseconds
+double percentile(const long long *sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("write");
+        buf += n;
+        len -= n;
+    }
+}
+
+// Time `n` commands one at a time. The shell reads from one pipe and writes
+// to the other, and the newline from the `echo` after each command is how
+// we know it is done
+void latency(const char *shell, const struct workload *w, size_t n, long long *samples)
+{
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) == -1 || pipe2(from, O_CLOEXEC) == -1)
+        die("pipe");
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, from[1], STDOUT_FILENO);
+
+    char *argv[] = {(char *)shell, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+    {
+        errno = err;
+        die(shell);
+    }
+    close(to[0]);
+    close(from[1]);
+
+    char *buf = NULL;
+    size_t cap = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const char *line = w->line(i);
+        size_t len = strlen(line);
+        if (len + 7 > cap)
+        {
+            cap = len + 7;
+            if ((buf = realloc(buf, cap)) == NULL)
+                die("realloc");
+        }
+        memcpy(buf, line, len);
+        memcpy(buf + len, "\necho\n", 6);
+
+        long long start = now_ns();
+        write_all(to[1], buf, len + 6);
+
+        char c = 0;
+        while (c != '\n')
+        {
+            ssize_t r = read(from[0], &c, 1);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+            {
+                fprintf(stderr, "bench: %s went away\n", shell);
+                exit(EXIT_FAILURE);
+            }
+        }
+        samples[i] = now_ns() - start;
+    }
+    free(buf);
+
+    close(to[1]);
+    close(from[0]);
+    waitpid(pid, NULL, 0);
+}
+
+void bench_shell(const char *shell, size_t commands, bool last)
+{
+    char *argv[] = {(char *)shell, "-c", "true", NULL};
+    long long *samples = malloc((commands > STARTUP_RUNS ? commands : STARTUP_RUNS) * sizeof(*samples));
+    if (samples == NULL)
+        die("malloc");
+
+    long maxrss = 0;
+    for (int i = 0; i < STARTUP_RUNS; ++i)
+        samples[i] = run(argv, -1, -1, &maxrss);
+    qsort(samples, STARTUP_RUNS, sizeof(*samples), compare_ll);
+
+    printf("    {\n");
+    printf("      \"shell\": \"%s\",\n", shell);
+    printf("      \"startup\": {\"runs\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, \"peak_rss_kb\": %ld},\n",
+           STARTUP_RUNS, percentile(samples, STARTUP_RUNS, 0.5),
+           percentile(samples, STARTUP_RUNS, 0.99), maxrss);
+    printf("      \"workloads\": [\n");
+
+    size_t nworkloads = sizeof(workloads) / sizeof(*workloads);
+    for (size_t w = 0; w < nworkloads; ++w)
+    {
+        size_t n = commands / workloads[w].divisor;
+        if (n == 0)
+            n = 1;
+
+        // The whole workload as a script
+        char script[sizeof(workdir) + 16];
+        snprintf(script, sizeof(script), "%s/script", workdir);
+        FILE *f = fopen(script, "w");
+        if (f == NULL)
+            die(script);
+        for (size_t i = 0; i < n; ++i)
+            fprintf(f, "%s\n", workloads[w].line(i));
+        if (fclose(f) == EOF)
+            die(script);
+
+        char *sargv[] = {(char *)shell, script, NULL};
+        double seconds = run(sargv, -1, -1, &maxrss) / 1e9;
+
+        size_t nsamples = n < LATENCY_SAMPLES ? n : LATENCY_SAMPLES;
+        latency(shell, &workloads[w], nsamples, samples);
+        qsort(samples, nsamples, sizeof(*samples), compare_ll);
+
+        printf("        {\"name\": \"%s\", \"description\": \"%s\", \"commands\": %zu, "
+               "\"seconds\": %.6f, \"commands_per_sec\": %.0f, "
+               "\"p50_us\": %.1f, \"p99_us\": %.1f, \"peak_rss_kb\": %ld}%s\n",
+               workloads[w].name, workloads[w].desc, n, seconds, n / seconds,
+               percentile(samples, nsamples, 0.5), percentile(samples, nsamples, 0.99),
+               maxrss, w + 1 < nworkloads ? "," : "");
+        fflush(stdout);
+    }
+
+    printf("      ]\n");
+    printf("    }%s\n", last ? "" : ",");
+    free(samples);
+}
+
+int main(int argc, char **argv)
+{
+    size_t commands = DEFAULT_COMMANDS;
+    int i = 1;
+
+    if (i + 1 < argc && !strcmp(argv[i], "-n"))
+    {
+        commands = strtoul(argv[i + 1], NULL, 10);
+        i += 2;
+    }
+    if (i == argc || commands == 0)
+    {
+        fputs("usage: bench [-n commands] shell...\n", stderr);
+        return 2;
+    }
+
+    // History would only measure the disk, and must not end up in the
+    // user's own history file either
+    setenv("MSH_HISTFILE", "", 1);
+
+    make_deep_dir();
+
+    printf("{\n");
+    printf("  \"commands\": %zu,\n", commands);
+    printf("  \"results\": [\n");
+    for (int s = i; s < argc; ++s)
+        bench_shell(argv[s], commands, s + 1 == argc);
+    printf("  ]\n");
+    printf("}\n");
+
+    remove_deep_dir();
+    return 0;
+}
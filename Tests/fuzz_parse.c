@@ -0,0 +1,119 @@
+// Fuzz harness for the parser, see `make fuzz`
+//
+// Each input is one line, and it goes through what the main loop does with
+// a line up to the point where something would run: history expansion,
+// splitting it into its pipelines and tokenizing every one of them, with
+// word expansion, globbing and redirections. Nothing is run.
+//
+// Built with -DMSH_LIBFUZZER it is a libFuzzer target. Otherwise it has its
+// own main that runs every file named on the command line, or stdin if
+// there are none, so it doubles as an AFL target and as a way to replay a
+// corpus or a crash under ASan:
+//
+//     clang -g -fsanitize=fuzzer,address,undefined -DMSH_LIBFUZZER Tests/fuzz_parse.c
+//     afl-clang-fast -g -fsanitize=address Tests/fuzz_parse.c
+//     ./fuzz_parse crash-1234...
+
+// The shell's own main is not ours
+#define main msh_main
+#include "../msh.c"
+#undef main
+
+#include <stdint.h>
+
+// A few commands for !!, !n and !prefix to find
+const char *fuzz_history[] = {
+    "echo one",
+    "ls -l | wc -l > out",
+    "export A=1 && echo $A",
+    "!!",
+};
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    init_env();
+    init_cwd();
+    for (size_t i = 0; i < sizeof(fuzz_history) / sizeof(*fuzz_history); ++i)
+    {
+        history[++hist_ptr].cmd = cmd_new(fuzz_history[i], strlen(fuzz_history[i]));
+        history[hist_ptr].status = -1;
+    }
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // One line at a time, like the reader hands them out
+    if (memchr(data, '\n', size) != NULL || memchr(data, '\0', size) != NULL)
+        return -1;
+
+    // $(...) runs its command while the word is parsed, and the point here
+    // is that nothing runs
+    if (memmem(data, size, "$(", 2) != NULL)
+        return -1;
+
+    char *line = malloc(size + 1);
+    if (line == NULL)
+        return 0;
+    memcpy(line, data, size);
+    line[size] = '\0';
+
+    char *cmd = expand_history(line);
+    if (cmd != NULL && parse_line(cmd))
+    {
+        list_line = cmd;
+        for (size_t i = 0; i < list_count; ++i)
+            parse_pipeline(i);
+    }
+
+    if (cmd != NULL && cmd != line)
+        cmd_unref(cmd);
+    free(line);
+    return 0;
+}
+
+#ifndef MSH_LIBFUZZER
+void fuzz_fd(int fd)
+{
+    uint8_t *buf = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t n;
+    do
+    {
+        if (len == cap && (buf = realloc(buf, cap = cap ? cap * 2 : 4096)) == NULL)
+        {
+            perror("fuzz_parse");
+            exit(EXIT_FAILURE);
+        }
+        n = read(fd, buf + len, cap - len);
+        if (n > 0)
+            len += n;
+    } while (n > 0 || (n < 0 && errno == EINTR));
+
+    // Files made by hand tend to end in a newline
+    if (len > 0 && buf[len - 1] == '\n')
+        len--;
+    LLVMFuzzerTestOneInput(buf, len);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    LLVMFuzzerInitialize(&argc, &argv);
+    if (argc == 1)
+        fuzz_fd(STDIN_FILENO);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd == -1)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        fuzz_fd(fd);
+        close(fd);
+    }
+    return 0;
+}
+#endif
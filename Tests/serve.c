@@ -0,0 +1,357 @@
+// Test client for `msh --serve`, see `make test_serve`
+//
+//     serve shell
+//
+// Starts the shell as a server on a socket in a fresh directory under /tmp
+// and talks to it the way a client would. Every reply has to be framed
+// right: `out <len>` and `err <len>` with exactly that many bytes after
+// them and one `done <status> <real_us> <user_us> <sys_us>` per line, after
+// all of its output. On top of that each connection has to keep its own
+// cwd and variables, a new connection has to start out clean, and two
+// clients have to be served at the same time rather than one after the
+// other. Prints what went wrong and exits 1 if anything did.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define START_TIMEOUT_MS 2000
+#define BIG_OUTPUT 300000
+
+extern char **environ;
+
+char sock_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+int failures = 0;
+
+// One connection and whatever it has read past the last reply
+struct conn
+{
+    int fd;
+    char *buf;
+    size_t len, cap;
+};
+
+// What one line got back
+struct reply
+{
+    char *out, *err;
+    size_t out_len, err_len;
+    int status;
+    bool ok; // Framed right and ended in a done
+};
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+void fail(const char *test, const char *what)
+{
+    fprintf(stderr, "serve: %s: %s\n", test, what);
+    failures++;
+}
+
+long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int try_connect()
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, sock_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        die("socket");
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct conn connect_shell()
+{
+    struct conn c = {.fd = try_connect()};
+    if (c.fd == -1)
+        die(sock_path);
+    return c;
+}
+
+void close_conn(struct conn *c)
+{
+    close(c->fd);
+    free(c->buf);
+}
+
+void send_line(struct conn *c, const char *line)
+{
+    size_t len = strlen(line);
+    char *buf = malloc(len + 1);
+    if (buf == NULL)
+        die("malloc");
+    memcpy(buf, line, len);
+    buf[len] = '\n';
+
+    for (size_t off = 0; off <= len;)
+    {
+        ssize_t n = send(c->fd, buf + off, len + 1 - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("send");
+        off += n;
+    }
+    free(buf);
+}
+
+// Make sure there are `need` bytes in the buffer. False at end of input
+bool fill(struct conn *c, size_t need)
+{
+    while (c->len < need)
+    {
+        if (c->cap - c->len < 65536)
+        {
+            c->cap = c->cap ? c->cap * 2 : 131072;
+            if ((c->buf = realloc(c->buf, c->cap)) == NULL)
+                die("realloc");
+        }
+        ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("read");
+        if (n == 0)
+            return false;
+        c->len += n;
+    }
+    return true;
+}
+
+void consume(struct conn *c, size_t n)
+{
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+}
+
+void append(char **to, size_t *len, const char *data, size_t n)
+{
+    if ((*to = realloc(*to, *len + n + 1)) == NULL)
+        die("realloc");
+    memcpy(*to + *len, data, n);
+    *len += n;
+    (*to)[*len] = '\0';
+}
+
+// Read frames up to and including the next done
+struct reply read_reply(struct conn *c)
+{
+    struct reply r = {.status = -1};
+    append(&r.out, &r.out_len, "", 0);
+    append(&r.err, &r.err_len, "", 0);
+
+    while (1)
+    {
+        // Headers are short, anything without a newline by then is garbage
+        char *nl;
+        while (c->len == 0 || (nl = memchr(c->buf, '\n', c->len)) == NULL)
+        {
+            if (c->len >= 128 || !fill(c, c->len + 1))
+                return r;
+        }
+
+        size_t head_len = nl + 1 - c->buf;
+        char head[128];
+        memcpy(head, c->buf, head_len - 1);
+        head[head_len - 1] = '\0';
+
+        char kind[8];
+        long long n, real, user, sys;
+        int status, end = 0;
+        if (sscanf(head, "done %d %lld %lld %lld%n", &status, &real, &user, &sys, &end) == 4 &&
+            end == (int)head_len - 1)
+        {
+            consume(c, head_len);
+            r.status = status;
+            r.ok = real >= 0 && user >= 0 && sys >= 0;
+            return r;
+        }
+        if (sscanf(head, "%7s %lld%n", kind, &n, &end) != 2 || end != (int)head_len - 1 || n <= 0 ||
+            (strcmp(kind, "out") && strcmp(kind, "err")))
+        {
+            fprintf(stderr, "serve: bad frame header `%s'\n", head);
+            return r;
+        }
+
+        if (!fill(c, head_len + n))
+            return r;
+        if (!strcmp(kind, "out"))
+            append(&r.out, &r.out_len, c->buf + head_len, n);
+        else
+            append(&r.err, &r.err_len, c->buf + head_len, n);
+        consume(c, head_len + n);
+    }
+}
+
+void free_reply(struct reply *r)
+{
+    free(r->out);
+    free(r->err);
+}
+
+// Run one line and check what came back. NULL for `out` means anything
+// goes, and `err` is only checked for being empty or not
+void expect(const char *test, struct conn *c, const char *line, int status, const char *out,
+            bool err)
+{
+    send_line(c, line);
+    struct reply r = read_reply(c);
+
+    char what[512];
+    if (!r.ok)
+        snprintf(what, sizeof(what), "`%s' got no done record", line);
+    else if (r.status != status)
+        snprintf(what, sizeof(what), "`%s' exited with %d, not %d", line, r.status, status);
+    else if (out != NULL && strcmp(r.out, out))
+        snprintf(what, sizeof(what), "`%s' printed `%.200s', not `%s'", line, r.out, out);
+    else if ((r.err_len > 0) != err)
+        snprintf(what, sizeof(what), "`%s' %s stderr", line, err ? "printed nothing on" : "printed on");
+    else
+        what[0] = '\0';
+
+    if (what[0] != '\0')
+        fail(test, what);
+    free_reply(&r);
+}
+
+pid_t start_server(const char *shell)
+{
+    char *argv[] = {(char *)shell, "--serve", sock_path, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, NULL, NULL, argv, environ);
+    if (err != 0)
+    {
+        errno = err;
+        die(shell);
+    }
+
+    // The socket is there once the server is listening
+    for (long long start = now_ms(); now_ms() - start < START_TIMEOUT_MS; usleep(10000))
+    {
+        int fd = try_connect();
+        if (fd != -1)
+        {
+            close(fd);
+            return pid;
+        }
+    }
+    fprintf(stderr, "serve: %s never started listening on %s\n", shell, sock_path);
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fputs("usage: serve shell\n", stderr);
+        return 2;
+    }
+
+    char dir[] = "/tmp/msh-serve.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("mkdtemp");
+    snprintf(sock_path, sizeof(sock_path), "%s/msh.sock", dir);
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+        die("getcwd");
+
+    setenv("MSH_HISTFILE", "", 1);
+    unsetenv("SERVE_X");
+    pid_t server = start_server(argv[1]);
+
+    // One line at a time, every kind of output, and state that has to
+    // carry over from one line to the next
+    struct conn a = connect_shell();
+    char *big;
+    if (asprintf(&big, "head -c %d /dev/zero | tr '\\0' x; echo", BIG_OUTPUT) == -1)
+        die("asprintf");
+    expect("framing", &a, "echo hello", 0, "hello\n", false);
+    expect("framing", &a, "ls /nonexistent-msh-serve", 2, "", true);
+    expect("framing", &a, "false", 1, "", false);
+    expect("framing", &a, "echo out; echo err >&2; /bin/echo ext", 0, "out\next\n", true);
+    send_line(&a, big);
+    struct reply r = read_reply(&a);
+    if (!r.ok || r.status != 0 || r.out_len != BIG_OUTPUT + 1)
+        fail("framing", "big output did not come back whole");
+    free_reply(&r);
+    free(big);
+
+    expect("state", &a, "cd /tmp; export SERVE_X=a", 0, "", false);
+    expect("state", &a, "echo $SERVE_X", 0, "a\n", false);
+    expect("state", &a, "pwd", 0, "/tmp\n", false);
+
+    // A new connection starts where the server did, while the old one is
+    // still where it was
+    char *start_pwd;
+    if (asprintf(&start_pwd, "[]\n%s\n", cwd) == -1)
+        die("asprintf");
+    struct conn b = connect_shell();
+    expect("isolation", &b, "echo [$SERVE_X]; pwd", 0, start_pwd, false);
+    expect("isolation", &b, "cd /; export SERVE_X=b", 0, "", false);
+    expect("isolation", &a, "echo $SERVE_X; pwd", 0, "a\n/tmp\n", false);
+    expect("isolation", &b, "echo $SERVE_X; pwd", 0, "b\n/\n", false);
+    free(start_pwd);
+
+    // Both get to run at once, so this takes one second and not two
+    long long start = now_ms();
+    send_line(&a, "sleep 1; echo a");
+    send_line(&b, "sleep 1; echo b");
+    struct reply ra = read_reply(&a), rb = read_reply(&b);
+    long long took = now_ms() - start;
+    if (!ra.ok || !rb.ok || strcmp(ra.out, "a\n") || strcmp(rb.out, "b\n"))
+        fail("concurrency", "the two sleeps did not both come back");
+    else if (took >= 1800)
+        fail("concurrency", "the two clients were served one after the other");
+    free_reply(&ra);
+    free_reply(&rb);
+
+    // Hanging up ends the worker, and a done for every line means nothing
+    // is left over after the last one
+    shutdown(a.fd, SHUT_WR);
+    if (fill(&a, a.len + 1))
+        fail("framing", "more output after the last done");
+    close_conn(&a);
+    close_conn(&b);
+
+    kill(server, SIGTERM);
+    int status;
+    if (waitpid(server, &status, 0) == -1)
+        die("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fail("shutdown", "the server did not exit cleanly on SIGTERM");
+    if (access(sock_path, F_OK) == 0)
+        fail("shutdown", "the socket was left behind");
+    unlink(sock_path);
+    rmdir(dir);
+    free(cwd);
+
+    printf("%s --serve: %s\n", argv[1], failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
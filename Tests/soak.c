@@ -0,0 +1,243 @@
+// Soak test for msh, see `make soak`
+//
+//     soak [-n commands] shell
+//
+// Feeds the shell a long mix of the things it does all day, builtins,
+// external commands, pipelines, redirections, lists, expansions, history
+// references, directory changes and background jobs, over one pipe, and
+// keeps an eye on its resident set and open descriptors from /proc while
+// it goes. Both are taken halfway through and again at the end, and have
+// to come out flat: the same descriptors, and no more than RSS_SLACK_KB of
+// growth. Halfway is late enough for ASan's own allocator caches, which
+// take a good ten thousand commands to fill up and then stay put. Run
+// against an ASan build the shell's exit also runs LeakSanitizer, and a
+// leak there fails the soak too.
+//
+// Some of the lines are errors on purpose, so the shell's stderr goes to
+// /dev/null. Sanitizer reports go to soak-asan.log.<pid> instead.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#define DEFAULT_COMMANDS 1000000
+#define SAMPLES 10
+#define RSS_SLACK_KB 1024
+
+extern char **environ;
+
+// Every line leaves stdout alone, so the newline from the `echo` sent
+// after each round is the only thing that ever comes back
+const char *lines[] = {
+    "true",
+    "echo a b c > /dev/null",
+    "/bin/true",
+    "echo x | cat | cat > /dev/null",
+    "false || true && echo yes > /dev/null; echo $? > /dev/null",
+    "export SOAK=1; echo $SOAK \"$HOME\" '$x' > /dev/null; unset SOAK",
+    "echo $(echo sub) $(pwd) > /dev/null",
+    "echo $(/bin/echo external) > /dev/null",
+    "echo /*/ > /dev/null",
+    "!!",
+    "cd /tmp; pushd / > /dev/null; popd > /dev/null; cd - > /dev/null",
+    "echo out 2>&1 > /dev/null < /dev/null",
+    "no-such-command-for-soak 2> /dev/null",
+    "/bin/true &",
+    "wait",
+    "echo \"unterminated > /dev/null",
+    "history > /dev/null",
+};
+
+void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            die("write");
+        buf += n;
+        len -= n;
+    }
+}
+
+long rss_kb(pid_t pid)
+{
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        die(path);
+
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+int fd_count(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        die(path);
+
+    int n = 0;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL)
+    {
+        if (d->d_name[0] != '.')
+            n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    size_t commands = DEFAULT_COMMANDS;
+    int i = 1;
+
+    if (i + 1 < argc && !strcmp(argv[i], "-n"))
+    {
+        commands = strtoul(argv[i + 1], NULL, 10);
+        i += 2;
+    }
+    if (i + 1 != argc || commands == 0)
+    {
+        fputs("usage: soak [-n commands] shell\n", stderr);
+        return 2;
+    }
+    const char *shell = argv[i];
+
+    // The history file would only grow, and is not the shell's memory.
+    // ASan keeps freed memory around for a while to catch use after free,
+    // which would look like growth, so keep that small
+    setenv("MSH_HISTFILE", "", 1);
+    setenv("ASAN_OPTIONS", "quarantine_size_mb=1:detect_leaks=1:log_path=soak-asan.log", 0);
+    setenv("UBSAN_OPTIONS", "halt_on_error=1:print_stacktrace=1:log_path=soak-asan.log", 0);
+
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) == -1 || pipe2(from, O_CLOEXEC) == -1)
+        die("pipe");
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, from[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    char *sargv[] = {(char *)shell, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &actions, NULL, sargv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0)
+    {
+        errno = err;
+        die(shell);
+    }
+    close(to[0]);
+    close(from[1]);
+
+    // One round is every line once, then the echo we wait for
+    size_t nlines = sizeof(lines) / sizeof(*lines);
+    char *round = NULL;
+    size_t round_len = 0;
+    FILE *f = open_memstream(&round, &round_len);
+    if (f == NULL)
+        die("open_memstream");
+    for (size_t l = 0; l < nlines; ++l)
+        fprintf(f, "%s\n", lines[l]);
+    fputs("echo\n", f);
+    fclose(f);
+
+    size_t rounds = (commands + nlines - 1) / nlines;
+    size_t step = rounds / SAMPLES ? rounds / SAMPLES : 1;
+    long rss_start = 0, rss_peak = 0, rss = 0;
+    int fds_start = 0, fds = 0;
+
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        write_all(to[1], round, round_len);
+
+        char c = 0;
+        while (c != '\n')
+        {
+            ssize_t n = read(from[0], &c, 1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                fprintf(stderr, "soak: %s went away after %zu commands\n", shell, r * nlines);
+                return 1;
+            }
+        }
+
+        // The shell is waiting for its next line now, so this is what it
+        // holds on to between commands
+        if ((r % step == 0 && r > 0) || r + 1 == rounds)
+        {
+            rss = rss_kb(pid);
+            fds = fd_count(pid);
+            if (rss_start == 0 && r >= rounds / 2)
+            {
+                rss_start = rss;
+                fds_start = fds;
+            }
+            if (rss > rss_peak)
+                rss_peak = rss;
+            fprintf(stderr, "soak: %zu commands, rss %ld kB, %d fds\n", (r + 1) * nlines, rss, fds);
+        }
+    }
+    free(round);
+
+    // End of input is `exit`, and its output still has somewhere to go
+    close(to[1]);
+    int status;
+    if (waitpid(pid, &status, 0) == -1)
+        die("waitpid");
+    close(from[0]);
+
+    bool ok = true;
+    if (fds != fds_start)
+    {
+        fprintf(stderr, "soak: fds went from %d to %d\n", fds_start, fds);
+        ok = false;
+    }
+    if (rss - rss_start > RSS_SLACK_KB)
+    {
+        fprintf(stderr, "soak: rss went from %ld kB to %ld kB\n", rss_start, rss);
+        ok = false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "soak: %s exited with status %d, see soak-asan.log.%d\n", shell,
+                status, (int)pid);
+        ok = false;
+    }
+
+    printf("%s: %zu commands, rss %ld -> %ld kB (peak %ld), fds %d -> %d: %s\n", shell,
+           rounds * nlines, rss_start, rss, rss_peak, fds_start, fds, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,14 @@
+#!/bin/bash
+
+# Feeds Tests/<name>.msh to the shell on stdin and compares what comes
+# out, stdout and stderr together and then its exit status, with
+# Tests/<name>.out. MSH picks the shell, e.g. MSH=./msh-asan
+export MSH=${MSH:-./msh}
+
+if diff -u $1.out <($MSH < $1.msh 2>&1; echo "exit $?"); then
+  echo "Pass: Test $1 passed"
+  exit 0
+else
+  echo "Fail: Test $1 failed"
+  exit 1
+fi
@@ -27,432 +27,8572 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <pwd.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+/*
+ * Build profiles
+ *
+ *   make            Everything, for people at a terminal
+ *   make msh-min    -DMSH_MINIMAL, -O2 and static. For running scripts in
+ *                   containers, where startup and size are what matter
+ *   make msh-school -DSCHOOL_MODE, everything but with the plain `msh> `
+ *                   prompt the tests expect
+ *
+ * A profile only picks defaults. Every feature can be switched on its own
+ * with -DMSH_FEATURE_X=0 or 1. The switches are plain constants tested
+ * with if (), not #ifdef, so everything still gets compiled and type
+ * checked in every profile, and the optimizer drops what is switched off.
+ */
+#ifdef MSH_MINIMAL
+#define MSH_FEATURE_DEFAULT 0
+#else
+#define MSH_FEATURE_DEFAULT 1
+#endif
+
+// The user@host:~/dir$ prompt, `msh> ` without it
+#ifndef MSH_FEATURE_PROMPT
+#ifdef SCHOOL_MODE
+#define MSH_FEATURE_PROMPT 0
+#else
+#define MSH_FEATURE_PROMPT MSH_FEATURE_DEFAULT
+#endif
+#endif
+
+// History kept across sessions in $MSH_HISTFILE
+#ifndef MSH_FEATURE_HISTLOG
+#define MSH_FEATURE_HISTLOG MSH_FEATURE_DEFAULT
+#endif
+
+// Process groups and the terminal for interactive sessions
+#ifndef MSH_FEATURE_JOB_CONTROL
+#define MSH_FEATURE_JOB_CONTROL MSH_FEATURE_DEFAULT
+#endif
+
+// MSH_TRACE
+#ifndef MSH_FEATURE_TRACE
+#define MSH_FEATURE_TRACE MSH_FEATURE_DEFAULT
+#endif
+
+// Raw mode line editing, history browsing and completion at a terminal
+#ifndef MSH_FEATURE_EDITOR
+#define MSH_FEATURE_EDITOR MSH_FEATURE_DEFAULT
+#endif
 
 #define WHITESPACE " \t\n" // We want to split our command line up into tokens
                            // so we need to define what delimits our tokens.
                            // In this case  white space
                            // will separate the tokens on our command line
 
-#define MAX_COMMAND_SIZE 255 // The maximum command-line size
+#define INITIAL_NUM_ARGUMENTS 16 // argv starts this big and doubles as needed
+
+#define HISTORY_SIZE 15
+
+#define CMD_TABLE_INITIAL_BUCKETS 64 // Must be a power of two
+
+#define DEFAULT_PATH "/bin:/usr/bin" // What execvp falls back to without PATH
+
+// The parsed arguments of the current line, always NULL terminated so it can
+// be used as argv. There is no fixed limit, the array grows as needed and the
+// kernel's ARG_MAX is the only thing that bounds a command
+char **token = NULL;
+size_t token_count = 0;
+size_t token_cap = 0;
+
+// Operators are never copied into the arena. Every operator token points at
+// its string here, so telling the `|` operator apart from a word that
+// happens to be "|" is a pointer comparison
+char op_pipe[] = "|";
+char op_amp[] = "&";
+char op_semi[] = ";";
+char op_and[] = "&&";
+char op_or[] = "||";
+
+// The pipelines a line is made of, see Lists
+struct list_item
+{
+    size_t start, len;  // Its text in the line, a `&` after it included
+    char *op;           // op_semi, op_and or op_or between it and the next
+};
+
+struct list_item *list = NULL;
+size_t list_count = 0;
+size_t list_cap = 0;
+const char *list_line = NULL;
+size_t list_parsed = SIZE_MAX; // Which one token[] holds, if any
+
+// The script plan line list[] came from, NULL if parse_line made it. See
+// Script plans
+struct plan_line;
+const struct plan_line *list_plan = NULL;
+bool plan_pipeline(size_t i);
+
+// Set by `exit` further into a line than its first pipeline
+bool exit_requested = false;
+
+// Where each stage of the current pipeline starts in token[]. The `|` tokens
+// are overwritten with NULL so every stage is its own argv. A line without
+// pipes is a single stage that starts at token[0]
+char ***stages = NULL;
+size_t stage_count = 0;
+
+// Set when the line ends in `&`
+bool background = false;
+
+// Redirections of the current line in the order they were written. They
+// aren't tokens, argv never sees them. Each one knows which stage it is for,
+// and all of a stage's come one after the other
+struct redirect
+{
+    int fd;           // The command's descriptor that gets replaced
+    int flags;        // How to open path, -1 if this is a dup
+    int from;         // For a dup the descriptor to copy, -1 closes fd
+    const char *path;
+    size_t stage;
+    int opened;       // path, opened by the shell for posix_spawn
+    int saved;        // fd as it was before a builtin in the shell got it,
+                      // -1 if it was closed and -2 if it was never touched
+};
+
+struct redirect *redirs = NULL;
+size_t redir_count = 0;
+size_t redir_cap = 0;
+
+// Points to the most recent command in history. Starts off as -1
+int hist_ptr = -1;
+
+struct command
+{
+    char *cmd;
+    pid_t *pids; // One per pipeline stage that was started
+    size_t npids;
+    unsigned long seq; // Tells a reused slot apart from the command it had
+    time_t when;       // Wall clock time it was started
+    bool pending;      // A job that outlived the command still owes us results
+
+    // Filled in once the command is done. Status is a wait status, -1 while
+    // it is still running or if nothing ever ran. CPU time and max RSS come
+    // from wait4 and cover every process the command started
+    int status;
+    long long start_us;
+    long long wall_us;
+    long long user_us;
+    long long sys_us;
+    long maxrss_kb;
+};
+
+unsigned long hist_seq = 0;
+
+// Zero-initialized
+struct command history[HISTORY_SIZE] = {0};
+
+// Cached pieces of the prompt, see init_prompt(). Up here because cd uses the
+// home directory and refreshes the prompt when it succeeds
+struct prompt_state
+{
+    char *uname;
+    char *home;
+    char hname[HOST_NAME_MAX + 1];
+    char *buf; // The finished prompt, reused every time it is rebuilt
+    size_t cap;
+};
+
+struct prompt_state prompt = {0};
+void refresh_prompt();
+char *pwd();
+
+// The environment, see further down
+const char *env_lookup(const char *name, size_t len);
+const char *env_get(const char *name);
+size_t env_name_len(const char *s);
+bool env_valid_name(const char *name, size_t len);
+
+// Exit status of the last command, for `$?`
+int last_status = 0;
+
+// Globbing lives with the directory cache further down
+extern unsigned long dircache_epoch;
+bool push_glob(char *word, const char *pattern);
+
+/*
+ * Tracing
+ *
+ * With MSH_TRACE=file in the environment, every phase of every command
+ * (reading the line, parsing it, starting and waiting for its processes and
+ * so on) is timed and kept in a ring buffer of the most recent events. At
+ * exit the ring is written to `file` as Chrome trace JSON, which loads
+ * straight into chrome://tracing or Perfetto.
+ *
+ * Without MSH_TRACE each trace point is a test of one global that is always
+ * false. Built without MSH_FEATURE_TRACE that test is a constant, so the
+ * calls, their arguments and the code that writes the file all compile
+ * away. What stays is the trace struct and the `long long` start time each
+ * trace point declares, which an optimized build like msh-min drops too.
+ */
+#define TRACE_EVENTS (64 * 1024) // Must be a power of two
+#define TRACE_DETAIL 48
+
+struct trace_event
+{
+    const char *name;  // Always a string literal
+    long long start;   // Nanoseconds since tracing started
+    long long dur;
+    long arg;          // A pid for events about one process, else -1
+    char detail[TRACE_DETAIL];
+};
+
+struct trace
+{
+    bool enabled;
+    char *path;
+    long long epoch;
+    struct trace_event *ring;
+    size_t next;       // Total events so far, the ring keeps the newest
+};
+
+struct trace trace = {0};
+
+#define TRACE_ON() __builtin_expect(MSH_FEATURE_TRACE && trace.enabled, 0)
+#define TRACE_BEGIN() (TRACE_ON() ? trace_now() : 0)
+#define TRACE_END(name, start) \
+    do { if (TRACE_ON()) trace_record(name, start, -1, NULL); } while (0)
+#define TRACE_END_ARG(name, start, arg, detail) \
+    do { if (TRACE_ON()) trace_record(name, start, arg, detail); } while (0)
+
+long long trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec - trace.epoch;
+}
+
+void trace_record(const char *name, long long start, long arg, const char *detail)
+{
+    struct trace_event *ev = &trace.ring[trace.next++ & (TRACE_EVENTS - 1)];
+    ev->name = name;
+    ev->start = start;
+    ev->dur = trace_now() - start;
+    ev->arg = arg;
+    ev->detail[0] = '\0';
+    if (detail != NULL)
+    {
+        strncpy(ev->detail, detail, TRACE_DETAIL - 1);
+        ev->detail[TRACE_DETAIL - 1] = '\0';
+    }
+}
+
+void init_trace()
+{
+    const char *path = getenv("MSH_TRACE");
+    if (!MSH_FEATURE_TRACE || path == NULL || *path == '\0')
+        return;
+
+    // The file is only written at exit, and a relative path is taken from
+    // where we started rather than wherever the last cd went
+    char *cwd = NULL;
+    if (path[0] == '/')
+        trace.path = strdup(path);
+    else if ((cwd = getcwd(NULL, 0)) == NULL || asprintf(&trace.path, "%s/%s", cwd, path) == -1)
+        trace.path = NULL;
+    free(cwd);
+    trace.ring = malloc(TRACE_EVENTS * sizeof(*trace.ring));
+    if (trace.path == NULL || trace.ring == NULL)
+    {
+        fputs("msh: not enough memory to trace\n", stderr);
+        free(trace.path);
+        free(trace.ring);
+        return;
+    }
+
+    trace.epoch = 0;
+    trace.epoch = trace_now();
+    trace.enabled = true;
+}
+
+// A string for JSON, which leaves out nothing but has to escape a few things
+void trace_json_string(FILE *f, const char *s)
+{
+    putc('"', f);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            putc(*s, f);
+    }
+    putc('"', f);
+}
+
+// Write out whatever is in the ring, oldest first, and stop tracing
+void close_trace()
+{
+    if (!MSH_FEATURE_TRACE || !trace.enabled)
+        return;
+    trace.enabled = false;
+
+    FILE *f = fopen(trace.path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "msh: %s: %s\n", trace.path, strerror(errno));
+        goto out;
+    }
+
+    size_t first = trace.next > TRACE_EVENTS ? trace.next - TRACE_EVENTS : 0;
+    int pid = getpid();
+
+    fputs("{\"traceEvents\":[\n", f);
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+               "\"args\":{\"name\":\"msh\"}}", pid, pid);
+    for (size_t i = first; i < trace.next; ++i)
+    {
+        const struct trace_event *ev = &trace.ring[i & (TRACE_EVENTS - 1)];
+
+        // Complete events, with times in microseconds
+        fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                ev->name, pid, pid, ev->start / 1000.0, ev->dur / 1000.0);
+        if (ev->arg != -1 || ev->detail[0] != '\0')
+        {
+            fputs(",\"args\":{", f);
+            if (ev->arg != -1)
+                fprintf(f, "\"pid\":%ld%s", ev->arg, ev->detail[0] ? "," : "");
+            if (ev->detail[0] != '\0')
+            {
+                fputs("\"cmd\":", f);
+                trace_json_string(f, ev->detail);
+            }
+            putc('}', f);
+        }
+        putc('}', f);
+    }
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", f);
+
+    if (fclose(f) == EOF)
+        fprintf(stderr, "msh: %s: %s\n", trace.path, strerror(errno));
+
+out:
+    free(trace.path);
+    free(trace.ring);
+}
+
+/*
+ * Per-line arena
+ *
+ * Everything parse_tokens produces for a line lives in here, so that a line
+ * costs no malloc/free pairs once the arena has grown to fit. All of it is
+ * thrown away at once by resetting the bump pointer to the first chunk.
+ * Chunks are never moved, so pointers into the arena stay valid until the
+ * next reset.
+ */
+#define ARENA_CHUNK_SIZE 4096
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t size;
+    char data[];
+};
+
+struct arena
+{
+    struct arena_chunk *head;
+    struct arena_chunk *cur;
+    size_t used; // Bytes handed out from cur
+};
+
+struct arena line_arena = {0};
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+    // Keep everything pointer aligned so the arena can hold more than strings
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    while (a->cur == NULL || a->used + n > a->cur->size)
+    {
+        // Move on to the next chunk we already have if it is big enough, else
+        // make a new one that fits and splice it in after the current one
+        struct arena_chunk *next = a->cur ? a->cur->next : a->head;
+        if (next == NULL || next->size < n)
+        {
+            size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+            struct arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+            if (chunk == NULL)
+                return NULL;
+
+            chunk->size = size;
+            chunk->next = next;
+            if (a->cur)
+                a->cur->next = chunk;
+            else
+                a->head = chunk;
+            next = chunk;
+        }
+        a->cur = next;
+        a->used = 0;
+    }
+
+    void *ptr = a->cur->data + a->used;
+    a->used += n;
+    return ptr;
+}
+
+void arena_reset(struct arena *a)
+{
+    a->cur = a->head;
+    a->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+    while (a->head != NULL)
+    {
+        struct arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->cur = NULL;
+    a->used = 0;
+}
+
+// Make room for at least `n` tokens plus the terminating NULL. Capacity is
+// doubled so a line with thousands of arguments only reallocates a few times,
+// and the array is kept between lines
+bool reserve_tokens(size_t n)
+{
+    if (n + 1 <= token_cap)
+        return true;
+
+    size_t cap = token_cap ? token_cap : INITIAL_NUM_ARGUMENTS;
+    while (cap < n + 1)
+        cap *= 2;
+
+    char **grown = realloc(token, cap * sizeof(*token));
+    if (grown == NULL)
+        return false;
+
+    token = grown;
+    token_cap = cap;
+    return true;
+}
+
+bool push_token(char *tok)
+{
+    if (!reserve_tokens(token_count + 1))
+        return false;
+
+    token[token_count++] = tok;
+    return true;
+}
+
+/*
+ * Words
+ *
+ * Most words are plain and are used right where they are in the line. One
+ * with quotes, backslashes or a `$` in it is put together in a scratch
+ * buffer and then copied to the arena:
+ *
+ *   'text'      Exactly text
+ *   "text"      text with $ expanded, \ only escapes $ ` " \ and newline
+ *   \c          c itself
+ *   $NAME ${NAME}  The variable's value, nothing if it isn't set
+ *   $?          Exit status of the last command
+ *   $$          Our pid
+ *   $(command)  What command printed, without its trailing newlines
+ *
+ * What a variable or a command substitution expands to is never split into
+ * more words or looked at again, wherever it appears, as if it was always in
+ * double quotes.
+ */
+struct word_buf
+{
+    char *buf;
+    size_t len, cap;
+};
+
+// The word being put together, and the same word as a glob pattern, with
+// whatever was quoted escaped so it only matches itself
+struct word_buf scratch_word = {0};
+struct word_buf scratch_pattern = {0};
+bool scratch_glob; // Something unquoted in it could be a pattern
+
+// Command substitution runs commands, so it lives down with them
+bool substitute(char *cmd, struct word_buf *out);
+struct word_buf subst_out = {0};
+
+// Where the `$(` at `p` ends, just past its `)`, or NULL if it doesn't.
+// Quotes and parentheses inside it are skipped over
+const char *subst_end(const char *p)
+{
+    int depth = 0;
+    for (p++; *p != '\0'; ++p)
+    {
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        else if (*p == '\'' && (p = strchr(p + 1, '\'')) == NULL)
+            return NULL;
+        else if (*p == '"')
+        {
+            for (p++; *p != '"'; ++p)
+            {
+                if (*p == '\0')
+                    return NULL;
+                if (*p == '\\' && p[1] != '\0')
+                    p++;
+                else if (*p == '$' && p[1] == '(')
+                {
+                    if ((p = subst_end(p)) == NULL)
+                        return NULL;
+                    p--;
+                }
+            }
+        }
+        else if (*p == '(')
+            depth++;
+        else if (*p == ')' && --depth == 0)
+            return p + 1;
+    }
+    return NULL;
+}
+
+bool word_append(struct word_buf *w, const char *s, size_t n)
+{
+    if (w->len + n + 1 > w->cap)
+    {
+        size_t cap = w->cap ? w->cap : 64;
+        while (cap < w->len + n + 1)
+            cap *= 2;
+        char *grown = realloc(w->buf, cap);
+        if (grown == NULL)
+            return false;
+        w->buf = grown;
+        w->cap = cap;
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    return true;
+}
+
+bool word_add(const char *s, size_t n, bool quoted)
+{
+    if (!word_append(&scratch_word, s, n))
+        return false;
+
+    if (!quoted)
+    {
+        scratch_glob = scratch_glob || memchr(s, '*', n) || memchr(s, '?', n) || memchr(s, '[', n);
+        return word_append(&scratch_pattern, s, n);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (s[i] != '\0' && strchr("*?[]\\", s[i]) && !word_append(&scratch_pattern, "\\", 1))
+            return false;
+        if (!word_append(&scratch_pattern, s + i, 1))
+            return false;
+    }
+    return true;
+}
+
+// Expand the `$` that `*pp` points at and move past what it used up
+bool word_expand(char **pp)
+{
+    char *p = *pp + 1;
+    const char *name = p;
+    size_t len;
+    char num[24];
+    const char *value;
+
+    if (*p == '(')
+    {
+        const char *end = subst_end(*pp);
+        if (end == NULL)
+        {
+            fputs("msh: syntax error: missing closing `)'\n", stderr);
+            return false;
+        }
+
+        // The command has to be terminated, and the line can't be
+        len = end - p - 2;
+        char *cmd = arena_alloc(&line_arena, len + 1);
+        if (cmd == NULL)
+        {
+            fputs("parse: out of memory\n", stderr);
+            return false;
+        }
+        memcpy(cmd, p + 1, len);
+        cmd[len] = '\0';
+        *pp = (char *)end;
+
+        if (!substitute(cmd, &subst_out))
+            return false;
+        while (subst_out.len > 0 && subst_out.buf[subst_out.len - 1] == '\n')
+            subst_out.len--;
+        if (!word_add(subst_out.buf, subst_out.len, true))
+        {
+            fputs("parse: out of memory\n", stderr);
+            return false;
+        }
+        return true;
+    }
+
+    if (*p == '{')
+    {
+        name = ++p;
+        len = strcspn(p, "}");
+        if (p[len] != '}' || (!env_valid_name(name, len) && !(len == 1 && (*name == '?' || *name == '$'))))
+        {
+            fputs("msh: bad substitution\n", stderr);
+            return false;
+        }
+        p += len + 1;
+    }
+    else if (*p == '?' || *p == '$')
+    {
+        len = 1;
+        p++;
+    }
+    else
+    {
+        len = env_name_len(name);
+        p += len;
+    }
+    *pp = p;
+
+    value = num;
+    if (len == 0) // A lone `$` is just a dollar sign
+        value = "$";
+    else if (len == 1 && *name == '?')
+        snprintf(num, sizeof(num), "%d", last_status);
+    else if (len == 1 && *name == '$')
+        snprintf(num, sizeof(num), "%d", (int)getpid());
+    else if ((value = env_lookup(name, len)) == NULL)
+        return true;
+
+    if (!word_add(value, strlen(value), true))
+    {
+        fputs("parse: out of memory\n", stderr);
+        return false;
+    }
+    return true;
+}
+
+// Read the word `*pp` points at, up to the first unquoted whitespace or
+// operator, and leave `*pp` there. A plain word is returned in place and is
+// not terminated yet. `*quoted` says whether any of it was quoted, which is
+// how `""` counts as a word while an unset `$X` doesn't. `*pattern` is the
+// word as a glob pattern if it might be one, else NULL. It is the word
+// itself when that has nothing quoted. NULL on errors, which are already
+// reported
+char *parse_word(char **pp, bool *quoted, char **pattern)
+{
+    char *p = *pp;
+    p += strcspn(p, WHITESPACE "|&<>'\"\\$");
+    *quoted = false;
+    if (*p == '\0' || !strchr("'\"\\$", *p))
+    {
+        char *word = *pp;
+        *pattern = NULL;
+        for (char *c = word; c < p && *pattern == NULL; ++c)
+        {
+            if (*c == '*' || *c == '?' || *c == '[')
+                *pattern = word;
+        }
+        *pp = p;
+        return word;
+    }
+
+    scratch_word.len = scratch_pattern.len = 0;
+    scratch_glob = false;
+    if (!word_add(*pp, p - *pp, false))
+        goto nomem;
+
+    while (*p != '\0' && !strchr(WHITESPACE "|&<>", *p))
+    {
+        if (*p == '\\')
+        {
+            // A backslash at the very end stays a backslash
+            if (p[1] == '\0')
+            {
+                if (!word_add(p++, 1, true))
+                    goto nomem;
+                continue;
+            }
+            *quoted = true;
+            if (!word_add(p + 1, 1, true))
+                goto nomem;
+            p += 2;
+        }
+        else if (*p == '\'')
+        {
+            char *end = strchr(p + 1, '\'');
+            if (end == NULL)
+            {
+                fputs("msh: syntax error: missing closing `''\n", stderr);
+                return NULL;
+            }
+            *quoted = true;
+            if (!word_add(p + 1, end - p - 1, true))
+                goto nomem;
+            p = end + 1;
+        }
+        else if (*p == '"')
+        {
+            *quoted = true;
+            for (p++; *p != '"'; )
+            {
+                if (*p == '\0')
+                {
+                    fputs("msh: syntax error: missing closing `\"'\n", stderr);
+                    return NULL;
+                }
+
+                if (*p == '$')
+                {
+                    if (!word_expand(&p))
+                        return NULL;
+                }
+                else if (*p == '\\' && p[1] == '\n')
+                    p += 2;
+                else if (*p == '\\' && p[1] != '\0' && strchr("$`\"\\", p[1]))
+                {
+                    if (!word_add(p + 1, 1, true))
+                        goto nomem;
+                    p += 2;
+                }
+                else if (!word_add(p++, 1, true))
+                    goto nomem;
+            }
+            p++;
+        }
+        else if (*p == '$')
+        {
+            if (!word_expand(&p))
+                return NULL;
+        }
+        else
+        {
+            size_t n = strcspn(p + 1, WHITESPACE "|&<>'\"\\$") + 1;
+            if (!word_add(p, n, false))
+                goto nomem;
+            p += n;
+        }
+    }
+
+    char *word = arena_alloc(&line_arena, scratch_word.len + 1);
+    if (word == NULL)
+        goto nomem;
+    memcpy(word, scratch_word.buf, scratch_word.len);
+    word[scratch_word.len] = '\0';
+
+    *pattern = NULL;
+    if (scratch_glob)
+    {
+        if ((*pattern = arena_alloc(&line_arena, scratch_pattern.len + 1)) == NULL)
+            goto nomem;
+        memcpy(*pattern, scratch_pattern.buf, scratch_pattern.len);
+        (*pattern)[scratch_pattern.len] = '\0';
+    }
+
+    *pp = p;
+    return word;
+
+nomem:
+    fputs("parse: out of memory\n", stderr);
+    return NULL;
+}
+
+// Parse the rest of a redirection. `*pp` points just past its `<` or `>`
+// and is moved past the file name or descriptor. `fd` is the number that was
+// written right up against the operator, -1 if there was none
+bool parse_redirect(char **pp, char delim, int fd, size_t stage)
+{
+    char *p = *pp;
+    struct redirect r = {
+        .fd = fd != -1 ? fd : delim == '<' ? STDIN_FILENO : STDOUT_FILENO,
+        .flags = -1,
+        .from = -1,
+        .stage = stage,
+        .opened = -1,
+        .saved = -2,
+    };
+
+    const char *op;
+    if (delim == '>' && *p == '>')
+    {
+        op = ">>";
+        r.flags = O_WRONLY | O_CREAT | O_APPEND;
+        p++;
+    }
+    else if (*p == '&')
+    {
+        op = delim == '<' ? "<&" : ">&";
+        p++;
+    }
+    else
+    {
+        op = delim == '<' ? "<" : ">";
+        r.flags = delim == '<' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+    }
+
+    p += strspn(p, WHITESPACE);
+    size_t len = strcspn(p, WHITESPACE "|&<>");
+    if (len == 0)
+    {
+        fprintf(stderr, "msh: syntax error near `%s'\n", op);
+        return false;
+    }
+
+    if (r.flags == -1)
+    {
+        // A dup takes a descriptor, or `-` to close it
+        if (len == 1 && *p == '-')
+            r.from = -1;
+        else if (strspn(p, "0123456789") == len && len <= 4)
+            r.from = atoi(p);
+        else
+        {
+            fprintf(stderr, "msh: syntax error near `%s'\n", op);
+            return false;
+        }
+        p += len;
+    }
+    else
+    {
+        char *start = p;
+        bool quoted;
+        char *pattern;
+        char *path = parse_word(&p, &quoted, &pattern);
+        if (path == NULL)
+            return false;
+        if (*path == '\0' && !quoted)
+        {
+            fputs("msh: ambiguous redirect\n", stderr);
+            return false;
+        }
+
+        // A plain name may run right into the next operator, which can't be
+        // overwritten with a terminator, so it gets a copy of its own
+        if (path == start)
+        {
+            len = p - start;
+            if ((path = arena_alloc(&line_arena, len + 1)) == NULL)
+            {
+                fputs("parse: out of memory\n", stderr);
+                return false;
+            }
+            memcpy(path, start, len);
+            path[len] = '\0';
+        }
+        r.path = path;
+    }
+
+    if (redir_count == redir_cap)
+    {
+        size_t cap = redir_cap ? redir_cap * 2 : 8;
+        struct redirect *grown = realloc(redirs, cap * sizeof(*grown));
+        if (grown == NULL)
+        {
+            fputs("parse: out of memory\n", stderr);
+            return false;
+        }
+        redirs = grown;
+        redir_cap = cap;
+    }
+    redirs[redir_count++] = r;
+
+    *pp = p;
+    return true;
+}
+
+/* Parse input*/
+
+// Tokenize one pipeline into token[], stages[] and redirs[]. Returns false
+// on errors, which are reported. A pipeline can come out empty without that
+// being an error, when all it had was redirections or an unset variable
+bool parse_tokens(const char *command_string, size_t len)
+{
+    // The previous pipeline's tokens all go away in one go. Directory
+    // listings for globbing get checked once per pipeline
+    arena_reset(&line_arena);
+    dircache_epoch++;
+
+    token_count = 0;
+    redir_count = 0;
+    if (!reserve_tokens(0))
+    {
+        fputs("parse: out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Copy the pipeline into the arena once and split it in place, token[]
+    // ends up pointing straight into that copy
+    char *working_string = arena_alloc(&line_arena, len + 1);
+    if (working_string == NULL)
+    {
+        fputs("parse: out of memory\n", stderr);
+        token[0] = NULL;
+        return false;
+    }
+    memcpy(working_string, command_string, len);
+    working_string[len] = '\0';
+
+    char *p = working_string;
+    size_t pipes = 0;
+
+    // Tokenize the input strings with whitespace used as the delimiter.
+    // Operators don't need spaces around them
+    while (1)
+    {
+        p += strspn(p, WHITESPACE);
+        if (*p == '\0')
+            break;
+
+        // A word runs until whitespace or an operator. The byte after it gets
+        // overwritten to terminate a plain word in place, so remember what it
+        // was
+        char *start = p;
+        bool quoted;
+        char *pattern;
+        char *word = parse_word(&p, &quoted, &pattern);
+        if (word == NULL)
+        {
+            token[0] = NULL;
+            token_count = stage_count = 0;
+            return false;
+        }
+        char delim = *p;
+        if (delim != '\0')
+            *p++ = '\0';
+        bool present = *word != '\0' || quoted;
+
+        if (delim == '<' || delim == '>')
+        {
+            // Digits right up against the operator say which descriptor it
+            // is for, `2>err`. Anything else in front of it is an argument
+            int fd = -1;
+            size_t digits = strspn(word, "0123456789");
+            if (word == start && digits > 0 && word[digits] == '\0' && digits <= 4)
+                fd = atoi(word);
+            else if (present && !push_glob(word, pattern))
+            {
+                fputs("parse: too many arguments\n", stderr);
+                token[0] = NULL;
+                token_count = stage_count = 0;
+                return false;
+            }
+
+            if (!parse_redirect(&p, delim, fd, pipes))
+            {
+                token[0] = NULL;
+                token_count = stage_count = 0;
+                return false;
+            }
+            continue;
+        }
+
+        char *op = delim == '|' ? op_pipe : delim == '&' ? op_amp : NULL;
+        if ((present && !push_glob(word, pattern)) || (op != NULL && !push_token(op)))
+        {
+            fputs("parse: too many arguments\n", stderr);
+            token[0] = NULL;
+            token_count = stage_count = 0;
+            return false;
+        }
+
+        if (delim == '|')
+            pipes++;
+    }
+
+    // A trailing `&` sends the whole line to the background. It isn't part
+    // of any stage's argv
+    background = token_count > 0 && token[token_count - 1] == op_amp;
+    if (background)
+        token_count--;
+
+    // Terminate the list so it can be handed to exec as argv
+    token[token_count] = NULL;
+
+    stage_count = 0;
+    if (token_count == 0)
+        return true;
+
+    // Cut the tokens up into pipeline stages
+    stages = arena_alloc(&line_arena, (pipes + 1) * sizeof(*stages));
+    if (stages == NULL)
+    {
+        fputs("parse: out of memory\n", stderr);
+        token[0] = NULL;
+        return false;
+    }
+
+    stages[stage_count++] = token;
+    for (size_t i = 0; i < token_count; ++i)
+    {
+        if (token[i] == op_amp)
+        {
+            fputs("msh: syntax error near `&'\n", stderr);
+            token_count = stage_count = 0;
+            token[0] = NULL;
+            return false;
+        }
+
+        if (token[i] != op_pipe)
+            continue;
+
+        // Every stage needs a command, `| a`, `a ||` and `a |` are all errors
+        if (stages[stage_count - 1] == &token[i] || i + 1 == token_count)
+        {
+            fputs("msh: syntax error near `|'\n", stderr);
+            token_count = stage_count = 0;
+            token[0] = NULL;
+            return false;
+        }
+
+        token[i] = NULL;
+        stages[stage_count++] = &token[i + 1];
+    }
+    return true;
+}
+
+/*
+ * Lists
+ *
+ * A line is a list of pipelines joined by operators:
+ *
+ *   a ; b      a, then b
+ *   a & b      a in the background, then b
+ *   a && b     b only if a succeeded
+ *   a || b     b only if a failed
+ *
+ * && and || bind equally tight and go left to right like in sh, so a
+ * pipeline is skipped or not based on the last one that did run. A `&`
+ * only ever sends the pipeline right before it to the background.
+ *
+ * The line is split into its pipelines once, which is also where syntax
+ * errors anywhere in it are caught, before anything runs. Each pipeline is
+ * only tokenized right before it runs, so `$?`, `export` and globs in it see
+ * what the ones before it did.
+ */
+bool list_push(size_t start, size_t end, char *op)
+{
+    if (list_count == list_cap)
+    {
+        size_t cap = list_cap ? list_cap * 2 : 8;
+        struct list_item *grown = realloc(list, cap * sizeof(*grown));
+        if (grown == NULL)
+        {
+            fputs("parse: out of memory\n", stderr);
+            return false;
+        }
+        list = grown;
+        list_cap = cap;
+    }
+    list[list_count++] = (struct list_item){start, end - start, op};
+    return true;
+}
+
+// Split `line` into list[]. Returns false on syntax errors, which are
+// reported. A blank line is an empty list
+bool parse_line(const char *line)
+{
+    list_line = line;
+    list_count = 0;
+    list_parsed = SIZE_MAX;
+    list_plan = NULL;
+
+    const char *p = line;
+    size_t start = 0;
+    bool empty = true;      // Nothing but whitespace since the last operator
+    const char *last = NULL;
+
+    while (*p != '\0')
+    {
+        char c = *p;
+        if (strchr(WHITESPACE, c))
+        {
+            p++;
+            continue;
+        }
+
+        // Operators in quotes and command substitutions are just text
+        if (c == '\\')
+            p += p[1] ? 2 : 1;
+        else if (c == '$' && p[1] == '(')
+        {
+            if ((p = subst_end(p)) == NULL)
+            {
+                fputs("msh: syntax error: missing closing `)'\n", stderr);
+                return false;
+            }
+        }
+        else if (c == '\'' || c == '"')
+        {
+            for (p++; *p != c && *p != '\0'; ++p)
+            {
+                if (c == '"' && *p == '\\' && p[1] != '\0')
+                    p++;
+                else if (c == '"' && *p == '$' && p[1] == '(')
+                {
+                    if ((p = subst_end(p)) == NULL)
+                    {
+                        fputs("msh: syntax error: missing closing `)'\n", stderr);
+                        return false;
+                    }
+                    p--;
+                }
+            }
+            if (*p == '\0')
+            {
+                fprintf(stderr, "msh: syntax error: missing closing `%c'\n", c);
+                return false;
+            }
+            p++;
+        }
+        else if (c == '&' && p > line && (p[-1] == '>' || p[-1] == '<'))
+            p++; // The & of a dup like 2>&1
+        else if (c == '|' && p[1] != '|')
+        {
+            if (empty)
+            {
+                fputs("msh: syntax error near `|'\n", stderr);
+                return false;
+            }
+            last = op_pipe;
+            p++;
+            empty = true;
+            continue;
+        }
+        else if (c == ';' || c == '&' || c == '|')
+        {
+            char *op = c == ';' ? op_semi : p[1] != c ? op_amp : c == '&' ? op_and : op_or;
+            if (empty)
+            {
+                fprintf(stderr, "msh: syntax error near `%s'\n", op);
+                return false;
+            }
+
+            // A `&` stays with its pipeline, which is what sends it to the
+            // background, and is then just like `;`
+            size_t end = p - line + (op == op_amp);
+            p += strlen(op);
+            if (!list_push(start, end, op == op_amp ? op_semi : op))
+                return false;
+            start = p - line;
+            last = op;
+            empty = true;
+            continue;
+        }
+        else
+            p++;
+
+        empty = false;
+    }
+
+    if (!empty)
+        return list_push(start, p - line, NULL);
+
+    // Only `;` and `&` can end a line
+    if (last == op_pipe || last == op_and || last == op_or)
+    {
+        fprintf(stderr, "msh: syntax error near `%s'\n", last);
+        list_count = 0;
+        return false;
+    }
+    return true;
+}
+
+// Tokenize pipeline `i` of the line unless token[] already holds it
+bool parse_pipeline(size_t i)
+{
+    if (list_parsed == i)
+        return token[0] != NULL || token_count == 0;
+
+    long long t = TRACE_BEGIN();
+    bool ok = plan_pipeline(i) || parse_tokens(list_line + list[i].start, list[i].len);
+    list_parsed = i;
+    TRACE_END("tokenize", t);
+    return ok;
+}
+
+/*
+ * Input reader
+ *
+ * Lines come out of one big buffer that is refilled with large read()s, so
+ * a script with millions of lines costs a few thousand syscalls instead of
+ * going through stdio a line at a time. A -c string is read the same way,
+ * it just never needs refilling.
+ */
+#define READ_BUFFER_SIZE (64 * 1024)
+
+struct line_reader
+{
+    int fd;         // -1 when reading from a string
+    bool seekable;  // Regular file, so read-ahead can be given back
+    bool eof;
+    char *buf;
+    size_t cap;
+    size_t start;   // First byte not handed out yet
+    size_t end;     // One past the last byte read
+};
+
+struct line_reader input = {0};
+
+// True when there is someone at a terminal typing commands at us
+bool interactive = false;
+
+void reader_open_fd(struct line_reader *r, int fd)
+{
+    struct stat st;
+
+    r->fd = fd;
+    r->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    r->eof = false;
+    r->cap = READ_BUFFER_SIZE;
+    r->buf = malloc(r->cap);
+    r->start = r->end = 0;
+
+    if (r->buf == NULL)
+    {
+        perror("msh");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void reader_open_string(struct line_reader *r, const char *str)
+{
+    r->fd = -1;
+    r->seekable = false;
+    r->eof = true;
+    r->end = strlen(str);
+    r->cap = r->end + 1;
+    r->buf = malloc(r->cap);
+    r->start = 0;
+
+    if (r->buf == NULL)
+    {
+        perror("msh");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(r->buf, str, r->cap);
+}
+
+// Returns the next line with its newline stripped, or NULL once the input is
+// used up. The line lives in the reader's buffer until the next call
+char *reader_getline(struct line_reader *r)
+{
+    while (1)
+    {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line, '\n', r->end - r->start);
+
+        if (nl != NULL)
+        {
+            *nl = '\0';
+            r->start = nl + 1 - r->buf;
+            return line;
+        }
+
+        if (r->eof)
+        {
+            if (r->start == r->end)
+                return NULL;
+
+            // Last line without a newline. There is always a spare byte at
+            // the end of the buffer for its terminator
+            r->buf[r->end] = '\0';
+            r->start = r->end;
+            return line;
+        }
+
+        // Slide the partial line to the front and make sure there is room to
+        // read more after it, keeping one byte spare for a terminator
+        if (r->start > 0)
+        {
+            memmove(r->buf, line, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if (r->cap - r->end < READ_BUFFER_SIZE / 2)
+        {
+            char *buf = realloc(r->buf, r->cap * 2);
+            if (buf == NULL)
+            {
+                perror("msh");
+                exit(EXIT_FAILURE);
+            }
+            r->buf = buf;
+            r->cap *= 2;
+        }
+
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            r->eof = true;
+        else
+            r->end += n;
+    }
+}
+
+// Children share our stdin. If we are reading the script from it we have
+// probably read past the current line already, so when we can, hand the
+// unused part back to the file before a child gets to read from it
+void reader_release_stdin()
+{
+    if (input.fd != STDIN_FILENO || !input.seekable || input.start == input.end)
+        return;
+
+    if (lseek(STDIN_FILENO, -(off_t)(input.end - input.start), SEEK_CUR) != -1)
+        input.start = input.end = 0;
+}
+
+/*
+ * Command hash table
+ *
+ * Every external command used to go through execvp in the child, which walks
+ * PATH with one failed execve per directory before it finds the binary. We
+ * instead resolve names in the parent once, remember the absolute path and
+ * let the child execve it directly. This also lets the parent report
+ * "Command not found" without forking at all.
+ */
+struct hash_entry
+{
+    char *name;
+    char *path;
+    unsigned hits;
+    struct hash_entry *next;
+};
+
+struct hash_entry **cmd_table = NULL;
+size_t cmd_table_buckets = 0;
+size_t cmd_table_count = 0;
+
+// The value of PATH the table was filled against. If PATH changes then every
+// cached path might be wrong, so we just throw the whole table away. The
+// environment bumps path_generation whenever PATH is set or unset
+char *cmd_table_path = NULL;
+unsigned long cmd_table_generation = 0;
+unsigned long path_generation = 1;
+
+// FNV-1a, good enough for short command and variable names
+size_t hash_bytes(const char *s, size_t len)
+{
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+size_t hash_string(const char *str)
+{
+    return hash_bytes(str, strlen(str));
+}
+
+void hash_forget_all()
+{
+    for (size_t i = 0; i < cmd_table_buckets; ++i)
+    {
+        struct hash_entry *e = cmd_table[i];
+        while (e != NULL)
+        {
+            struct hash_entry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        cmd_table[i] = NULL;
+    }
+    cmd_table_count = 0;
+}
+
+void hash_forget(const char *name)
+{
+    if (cmd_table == NULL)
+        return;
+
+    struct hash_entry **link = &cmd_table[hash_string(name) & (cmd_table_buckets - 1)];
+    for (; *link != NULL; link = &(*link)->next)
+    {
+        if (!strcmp((*link)->name, name))
+        {
+            struct hash_entry *e = *link;
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            cmd_table_count--;
+            return;
+        }
+    }
+}
+
+// Drop everything we know if PATH is not what it was when we cached it
+void hash_check_path()
+{
+    if (cmd_table_generation == path_generation)
+        return;
+
+    const char *path = env_get("PATH");
+    if (path == NULL)
+        path = DEFAULT_PATH;
+
+    hash_forget_all();
+    free(cmd_table_path);
+    cmd_table_path = strdup(path);
+    cmd_table_generation = path_generation;
+}
+
+struct hash_entry *hash_find(const char *name)
+{
+    if (cmd_table == NULL)
+        return NULL;
+
+    struct hash_entry *e = cmd_table[hash_string(name) & (cmd_table_buckets - 1)];
+    for (; e != NULL; e = e->next)
+    {
+        if (!strcmp(e->name, name))
+            return e;
+    }
+    return NULL;
+}
+
+void hash_insert(char *name, char *path)
+{
+    // Keep the chains short by doubling the buckets once we average one entry
+    // per bucket
+    if (cmd_table_count >= cmd_table_buckets)
+    {
+        size_t buckets = cmd_table_buckets ? cmd_table_buckets * 2 : CMD_TABLE_INITIAL_BUCKETS;
+        struct hash_entry **table = calloc(buckets, sizeof(*table));
+        if (table == NULL)
+        {
+            free(name);
+            free(path);
+            return;
+        }
+
+        for (size_t i = 0; i < cmd_table_buckets; ++i)
+        {
+            struct hash_entry *e = cmd_table[i];
+            while (e != NULL)
+            {
+                struct hash_entry *next = e->next;
+                size_t b = hash_string(e->name) & (buckets - 1);
+                e->next = table[b];
+                table[b] = e;
+                e = next;
+            }
+        }
+
+        free(cmd_table);
+        cmd_table = table;
+        cmd_table_buckets = buckets;
+    }
+
+    struct hash_entry *e = malloc(sizeof(*e));
+    if (e == NULL)
+    {
+        free(name);
+        free(path);
+        return;
+    }
+
+    size_t b = hash_string(name) & (cmd_table_buckets - 1);
+    e->name = name;
+    e->path = path;
+    e->hits = 0;
+    e->next = cmd_table[b];
+    cmd_table[b] = e;
+    cmd_table_count++;
+}
+
+// Walk PATH the way execvp would and return a malloc'd absolute path to the
+// first executable called `name`, or NULL if there isn't one
+char *search_path(const char *name)
+{
+    const char *dirs = cmd_table_path;
+    size_t name_len = strlen(name);
+
+    while (dirs != NULL)
+    {
+        const char *end = strchr(dirs, ':');
+        size_t elem_len = end ? (size_t)(end - dirs) : strlen(dirs);
+
+        // An empty PATH element means the current directory
+        const char *dir = elem_len ? dirs : ".";
+        size_t dir_len = elem_len ? elem_len : 1;
+        char *candidate = malloc(dir_len + 1 + name_len + 1);
+        if (candidate == NULL)
+            return NULL;
+
+        memcpy(candidate, dir, dir_len);
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        // stat is the cheap filter since most directories won't have it, only
+        // the hit pays for the access check
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            return candidate;
+
+        free(candidate);
+        dirs = end ? end + 1 : NULL;
+    }
+
+    return NULL;
+}
+
+// Returns the path to execute for `name`, or NULL if it can't be found.
+// Names that contain a slash are paths already and are never hashed
+const char *hash_lookup(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    hash_check_path();
+
+    struct hash_entry *e = hash_find(name);
+    if (e == NULL)
+    {
+        char *path = search_path(name);
+        if (path == NULL)
+            return NULL;
+
+        hash_insert(strdup(name), path);
+        e = hash_find(name);
+        if (e == NULL)
+            return NULL;
+    }
+
+    e->hits++;
+    return e->path;
+}
+
+void print_hash_table()
+{
+    if (cmd_table_count == 0)
+    {
+        puts("hash: hash table empty");
+        return;
+    }
+
+    puts("hits\tcommand");
+    for (size_t i = 0; i < cmd_table_buckets; ++i)
+    {
+        for (struct hash_entry *e = cmd_table[i]; e != NULL; e = e->next)
+            printf("%4u\t%s\n", e->hits, e->path);
+    }
+}
+
+/*
+ * Script plans
+ *
+ * With MSH_PLANCACHE=dir in the environment, a script run as `msh script`
+ * has its parse kept in dir, in a file named after a hash of the script's
+ * contents. The next run of the same script maps that file and takes its
+ * lines straight from it instead of tokenizing them again, and starts off
+ * with the command hash table already filled. The hash only finds the
+ * plan. It is used for the file it was made from, with the same inode and
+ * modification time, and every line has to be as long as it was then.
+ *
+ * Only what can't come out differently is kept. Every line is split into
+ * its pipelines, and a pipeline with no `$`, glob characters or history
+ * reference in it is kept tokenized, argv, stages and redirections. The
+ * rest are tokenized when they run like always. The commands that were
+ * looked up in PATH are kept with the modification time of every PATH
+ * directory, and are only used if PATH is the same and none of its
+ * directories changed. If they did, the commands are looked up again and
+ * the plan gets rewritten at exit.
+ *
+ * A plan file is the header, then the PATH directories' modification
+ * times, the lines, pipelines, redirections, tokens, strings and names one
+ * after the other, with nothing in between. Offsets into the strings are all
+ * 32 bits, so a script needs to stay under 4G of words. Bump PLAN_MAGIC
+ * whenever parse_line or parse_tokens start producing something different.
+ */
+#define PLAN_MAGIC "mshplan2"
+#define PLAN_NONE UINT32_MAX    // A stage boundary in tokens, no path in a redirect
+
+struct plan_header
+{
+    char magic[8];
+    uint64_t script_hash;
+    uint64_t script_size;
+    int64_t script_mtime;       // In nanoseconds
+    uint64_t script_ino, script_dev;
+    uint32_t nlines, nitems, ntokens, nredirs;
+    uint32_t strings_len;       // Words and redirection paths
+    uint32_t ndirs;             // PATH directories, 0 when commands were not kept
+    uint32_t ncommands;
+    uint32_t names_len;         // PATH, then the name and path of every command
+};
+
+struct plan_line
+{
+    uint32_t first_item, nitems;
+    uint32_t planned;           // 0 if parse_line has to see it, like `!!`
+    uint32_t len;               // Of the line, without its newline
+};
+
+struct plan_item
+{
+    uint32_t start, len;
+    uint32_t op;                // Index into plan_ops
+    uint32_t tokenized;         // 0 if it is tokenized when it runs
+    uint32_t background;
+    uint32_t first_token, ntokens;
+    uint32_t first_redir, nredirs;
+};
+
+struct plan_redirect
+{
+    int32_t fd, flags, from;
+    uint32_t path;
+    uint32_t stage;
+};
+
+char *const plan_ops[] = {NULL, op_semi, op_and, op_or};
+
+struct plan
+{
+    bool enabled;
+    char *file;                 // Where the plan is kept
+    char *path;                 // PATH when we started
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t ino, dev;
+
+    // A plan that was loaded points into the map, one that was just made is
+    // in arrays of its own
+    char *map;
+    size_t maplen;
+    bool owned;
+    struct plan_line *lines;
+    struct plan_item *items;
+    uint32_t *tokens;
+    struct plan_redirect *redirs;
+    char *strings;
+    uint32_t nlines, nitems, ntokens, nredirs, strings_len;
+    size_t lines_cap, items_cap, tokens_cap, redirs_cap, strings_cap;
+
+    uint32_t next_line;         // Of the script, for the main loop
+    size_t preloaded;           // Commands put in the hash table from the plan
+    bool dirty;                 // Has to be written out at exit
+};
+
+struct plan plan = {0};
+
+// Make room for one more in a plan table, false if we are out of memory
+bool plan_grow(void **table, size_t *cap, size_t count, size_t size)
+{
+    if (count < *cap)
+        return true;
+    if (count >= UINT32_MAX / 2)
+        return false;
+
+    size_t grown = *cap ? *cap * 2 : 1024;
+    void *p = realloc(*table, grown * size);
+    if (p == NULL)
+        return false;
+    *table = p;
+    *cap = grown;
+    return true;
+}
+
+// Add a string to the plan's strings and return where it went
+uint32_t plan_string(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    if (plan.strings_len + len >= UINT32_MAX)
+        return PLAN_NONE;
+
+    while (plan.strings_len + len > plan.strings_cap)
+    {
+        size_t cap = plan.strings_cap ? plan.strings_cap * 2 : 64 * 1024;
+        char *grown = realloc(plan.strings, cap);
+        if (grown == NULL)
+            return PLAN_NONE;
+        plan.strings = grown;
+        plan.strings_cap = cap;
+    }
+
+    uint32_t off = plan.strings_len;
+    memcpy(plan.strings + off, s, len);
+    plan.strings_len += len;
+    return off;
+}
+
+// Keep one pipeline of the line parse_line just did as tokens. False if it
+// has to be tokenized when it runs instead
+bool plan_tokenize(const char *line, const struct list_item *li, struct plan_item *item)
+{
+    // Anything with an expansion or a glob in it depends on when it runs
+    for (size_t k = 0; k < li->len; ++k)
+    {
+        if (strchr("$*?[", line[li->start + k]))
+            return false;
+    }
+    if (!parse_tokens(line + li->start, li->len))
+        return false;
+
+    item->background = background;
+    item->first_token = plan.ntokens;
+    item->ntokens = token_count;
+    item->first_redir = plan.nredirs;
+    item->nredirs = redir_count;
+
+    for (size_t k = 0; k < token_count; ++k)
+    {
+        if (!plan_grow((void **)&plan.tokens, &plan.tokens_cap, plan.ntokens, sizeof(*plan.tokens)))
+            return false;
+        uint32_t off = token[k] == NULL ? PLAN_NONE : plan_string(token[k]);
+        if (token[k] != NULL && off == PLAN_NONE)
+            return false;
+        plan.tokens[plan.ntokens++] = off;
+    }
+
+    for (size_t k = 0; k < redir_count; ++k)
+    {
+        if (!plan_grow((void **)&plan.redirs, &plan.redirs_cap, plan.nredirs, sizeof(*plan.redirs)))
+            return false;
+        const struct redirect *r = &redirs[k];
+        uint32_t path = r->path == NULL ? PLAN_NONE : plan_string(r->path);
+        if (r->path != NULL && path == PLAN_NONE)
+            return false;
+        plan.redirs[plan.nredirs++] = (struct plan_redirect){r->fd, r->flags, r->from, path, r->stage};
+    }
+    return true;
+}
+
+// Parse every line of the script into a new plan. Syntax errors are for
+// when a line runs, if it ever does, so they are kept quiet here and the
+// line is just left to parse_line
+bool plan_compile(const char *script, size_t len)
+{
+    plan.owned = true;
+
+    fflush(stderr);
+    int saved = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (saved != -1 && null != -1)
+        dup2(null, STDERR_FILENO);
+
+    char *buf = NULL;
+    size_t cap = 0;
+    bool ok = true;
+    const char *p = script, *end = script + len;
+    while (ok && p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = nl != NULL ? (size_t)(nl - p) : (size_t)(end - p);
+        if (n + 1 > cap)
+        {
+            cap = n + 1 > 256 ? n + 1 : 256;
+            char *grown = realloc(buf, cap);
+            if (grown == NULL)
+            {
+                ok = false;
+                break;
+            }
+            buf = grown;
+        }
+        memcpy(buf, p, n);
+        buf[n] = '\0';
+        p = nl != NULL ? nl + 1 : end;
+
+        if (!plan_grow((void **)&plan.lines, &plan.lines_cap, plan.nlines, sizeof(*plan.lines)))
+        {
+            ok = false;
+            break;
+        }
+        struct plan_line *line = &plan.lines[plan.nlines++];
+        *line = (struct plan_line){plan.nitems, 0, 0, n};
+
+        // A history reference is a different line every time
+        if (n >= UINT32_MAX || buf[strspn(buf, WHITESPACE)] == '!' || !parse_line(buf))
+            continue;
+
+        for (size_t i = 0; i < list_count; ++i)
+        {
+            if (!plan_grow((void **)&plan.items, &plan.items_cap, plan.nitems, sizeof(*plan.items)))
+            {
+                ok = false;
+                break;
+            }
+            struct plan_item *item = &plan.items[plan.nitems++];
+            *item = (struct plan_item){.start = list[i].start, .len = list[i].len};
+            while (plan_ops[item->op] != list[i].op)
+                item->op++;
+            item->tokenized = plan_tokenize(buf, &list[i], item);
+        }
+        line->nitems = list_count;
+        line->planned = 1;
+    }
+    free(buf);
+    list_count = 0;
+    list_parsed = SIZE_MAX;
+    token[0] = NULL;
+    token_count = redir_count = stage_count = 0;
+
+    if (saved != -1)
+    {
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+    }
+    if (null != -1)
+        close(null);
+
+    // Even a script with no words at all gets a string table, so every
+    // loaded plan can be checked the same way
+    if (ok && plan.strings_len == 0 && plan_string("") == PLAN_NONE)
+        ok = false;
+    return ok;
+}
+
+// Modification time of a PATH directory in nanoseconds, -1 if it is missing
+int64_t plan_dir_mtime(const char *dir, size_t len)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    if (len >= sizeof(path))
+        return -1;
+    memcpy(path, dir, len);
+    path[len] = '\0';
+    if (stat(path, &st) == -1)
+        return -1;
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// How many directories are in PATH, 0 if any of them are relative, since
+// what is found in those depends on where we are
+uint32_t plan_count_dirs(const char *path)
+{
+    uint32_t n = 0;
+    for (const char *d = path; d != NULL; ++n)
+    {
+        if (*d != '/')
+            return 0;
+        d = strchr(d, ':');
+        if (d != NULL)
+            d++;
+    }
+    return n;
+}
+
+// Whether the hash table has anything in it worth keeping: it has to be for
+// the PATH we started with, and one that doesn't depend on where we are
+bool plan_keeps_commands()
+{
+    return cmd_table_path != NULL && !strcmp(cmd_table_path, plan.path) &&
+           plan_count_dirs(plan.path) > 0;
+}
+
+// Fill the hash table from a loaded plan, if PATH and its directories are
+// what they were when the commands were found
+void plan_preload(const struct plan_header *h, const int64_t *mtimes, const char *names)
+{
+    if (strcmp(names, plan.path) != 0 || plan_count_dirs(plan.path) != h->ndirs)
+    {
+        plan.dirty = true;
+        return;
+    }
+
+    const char *d = plan.path;
+    for (uint32_t i = 0; i < h->ndirs; ++i)
+    {
+        const char *end = strchr(d, ':');
+        size_t len = end ? (size_t)(end - d) : strlen(d);
+        if (plan_dir_mtime(d, len) != mtimes[i])
+        {
+            plan.dirty = true;
+            return;
+        }
+        d += len + 1;
+    }
+
+    const char *p = names + strlen(names) + 1;
+    for (uint32_t i = 0; i < h->ncommands; ++i)
+    {
+        const char *path = p + strlen(p) + 1;
+        if (hash_find(p) == NULL)
+            hash_insert(strdup(p), strdup(path));
+        p = path + strlen(path) + 1;
+    }
+    plan.preloaded = cmd_table_count;
+}
+
+// argv and paths come straight out of a plan, so only ones that nobody
+// else could have written are any good
+bool plan_trusted(const struct stat *st)
+{
+    return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// Map the plan file and check that it is a whole, sane plan for this
+// script. Anything off and it is as if there was none. The map is private
+// and writable, argv ends up pointing into it and nothing gets written back
+bool plan_load()
+{
+    int fd = open(plan.file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && plan_trusted(&st) &&
+        (size_t)st.st_size >= sizeof(struct plan_header))
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    size_t len = st.st_size;
+    const struct plan_header *h = (const struct plan_header *)map;
+    uint64_t need = sizeof(*h) + (uint64_t)h->ndirs * sizeof(int64_t) +
+                    (uint64_t)h->nlines * sizeof(struct plan_line) +
+                    (uint64_t)h->nitems * sizeof(struct plan_item) +
+                    (uint64_t)h->nredirs * sizeof(struct plan_redirect) +
+                    (uint64_t)h->ntokens * sizeof(uint32_t) + h->strings_len + h->names_len;
+    if (memcmp(h->magic, PLAN_MAGIC, sizeof(h->magic)) != 0 || h->script_hash != plan.hash ||
+        h->script_size != plan.size || h->script_mtime != plan.mtime ||
+        h->script_ino != plan.ino || h->script_dev != plan.dev || need != len ||
+        h->strings_len == 0 || h->names_len == 0)
+        goto bad;
+
+    char *p = map + sizeof(*h);
+    const int64_t *mtimes = (const int64_t *)p;
+    p += h->ndirs * sizeof(int64_t);
+    plan.lines = (struct plan_line *)p;
+    p += h->nlines * sizeof(struct plan_line);
+    plan.items = (struct plan_item *)p;
+    p += h->nitems * sizeof(struct plan_item);
+    plan.redirs = (struct plan_redirect *)p;
+    p += h->nredirs * sizeof(struct plan_redirect);
+    plan.tokens = (uint32_t *)p;
+    p += h->ntokens * sizeof(uint32_t);
+    plan.strings = p;
+    p += h->strings_len;
+    const char *names = p;
+
+    // Every index has to land inside its table and every string has to end
+    // inside the strings, then nothing needs checking when it is used
+    if (plan.strings[h->strings_len - 1] != '\0' || names[h->names_len - 1] != '\0')
+        goto bad;
+    for (uint32_t i = 0; i < h->nlines; ++i)
+    {
+        const struct plan_line *l = &plan.lines[i];
+        if (l->first_item > h->nitems || l->nitems > h->nitems - l->first_item ||
+            l->len > h->script_size)
+            goto bad;
+        for (uint32_t k = 0; k < l->nitems; ++k)
+        {
+            const struct plan_item *it = &plan.items[l->first_item + k];
+            if (it->start > l->len || it->len > l->len - it->start)
+                goto bad;
+        }
+    }
+    for (uint32_t i = 0; i < h->nitems; ++i)
+    {
+        const struct plan_item *it = &plan.items[i];
+        if (it->op >= sizeof(plan_ops) / sizeof(*plan_ops))
+            goto bad;
+        if (it->tokenized && (it->first_token > h->ntokens || it->ntokens > h->ntokens - it->first_token ||
+                              it->first_redir > h->nredirs || it->nredirs > h->nredirs - it->first_redir))
+            goto bad;
+    }
+    for (uint32_t i = 0; i < h->ntokens; ++i)
+    {
+        if (plan.tokens[i] != PLAN_NONE && plan.tokens[i] >= h->strings_len)
+            goto bad;
+    }
+    for (uint32_t i = 0; i < h->nredirs; ++i)
+    {
+        if (plan.redirs[i].path != PLAN_NONE && plan.redirs[i].path >= h->strings_len)
+            goto bad;
+    }
+    size_t strings = 0;
+    for (const char *s = names; s < names + h->names_len; s += strlen(s) + 1)
+        strings++;
+    if (strings != 1 + 2 * (size_t)h->ncommands)
+        goto bad;
+
+    plan.map = map;
+    plan.maplen = len;
+    plan.nlines = h->nlines;
+    plan.nitems = h->nitems;
+    plan.ntokens = h->ntokens;
+    plan.nredirs = h->nredirs;
+    plan.strings_len = h->strings_len;
+    plan_preload(h, mtimes, names);
+    return true;
+
+bad:
+    munmap(map, len);
+    plan.lines = NULL;
+    plan.items = NULL;
+    plan.redirs = NULL;
+    plan.tokens = NULL;
+    plan.strings = NULL;
+    return false;
+}
+
+// Find or make the plan for the script open on `fd`
+void init_plan(int fd)
+{
+    const char *dir = getenv("MSH_PLANCACHE");
+    if (dir == NULL || *dir == '\0')
+        return;
+
+    // A cache directory we make is ours alone. One that is already there
+    // has to be just as private
+    long long t = TRACE_BEGIN();
+    struct stat st;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return;
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode) || !plan_trusted(&st))
+    {
+        fprintf(stderr, "msh: %s: plan cache is not private, not using it\n", dir);
+        return;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return;
+    char *script = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (script == MAP_FAILED)
+        return;
+
+    hash_check_path();
+    plan.path = strdup(cmd_table_path ? cmd_table_path : DEFAULT_PATH);
+    plan.hash = hash_bytes(script, st.st_size);
+    plan.size = st.st_size;
+    plan.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    plan.ino = st.st_ino;
+    plan.dev = st.st_dev;
+    if (plan.path == NULL || asprintf(&plan.file, "%s/%016llx.plan", dir,
+                                      (unsigned long long)plan.hash) == -1)
+    {
+        plan.file = NULL;
+        munmap(script, st.st_size);
+        return;
+    }
+
+    if (plan_load())
+    {
+        plan.enabled = true;
+    }
+    else if (plan_compile(script, st.st_size))
+    {
+        plan.enabled = true;
+        plan.dirty = true;
+    }
+    munmap(script, st.st_size);
+    TRACE_END("plan", t);
+}
+
+// The next line of the script, NULL if it has no plan. The main loop asks
+// once for every line it reads, whatever happens to the line after that
+const struct plan_line *plan_next_line()
+{
+    if (!plan.enabled || plan.next_line >= plan.nlines)
+        return NULL;
+
+    const struct plan_line *l = &plan.lines[plan.next_line++];
+    return l->planned ? l : NULL;
+}
+
+// What parse_line would have made of `line`. A line that doesn't match
+// the plan's means the script changed under us, and then the plan is no
+// good for the rest of it either, or for the next run
+bool plan_use_line(const struct plan_line *l, const char *line)
+{
+    size_t len = strlen(line);
+    bool fits = len == l->len;
+    for (uint32_t i = 0; fits && i < l->nitems; ++i)
+    {
+        const struct plan_item *it = &plan.items[l->first_item + i];
+        fits = it->start <= len && it->len <= len - it->start;
+    }
+    if (!fits)
+    {
+        unlink(plan.file);
+        plan.enabled = false;
+        return parse_line(line);
+    }
+
+    list_line = line;
+    list_count = 0;
+    list_parsed = SIZE_MAX;
+    list_plan = NULL;
+
+    for (uint32_t i = 0; i < l->nitems; ++i)
+    {
+        const struct plan_item *it = &plan.items[l->first_item + i];
+        if (!list_push(it->start, it->start + it->len, plan_ops[it->op]))
+            return false;
+    }
+    list_plan = l;
+    return true;
+}
+
+// What parse_tokens would have made of pipeline `i` of the line, if it was
+// kept tokenized. False otherwise, and it has to be tokenized after all
+bool plan_pipeline(size_t i)
+{
+    if (list_plan == NULL)
+        return false;
+    const struct plan_item *it = &plan.items[list_plan->first_item + i];
+    if (!it->tokenized)
+        return false;
+
+    arena_reset(&line_arena);
+    dircache_epoch++;
+    if (!reserve_tokens(it->ntokens))
+        return false;
+
+    size_t nstages = it->ntokens > 0;
+    const uint32_t *tokens = &plan.tokens[it->first_token];
+    for (uint32_t k = 0; k < it->ntokens; ++k)
+    {
+        token[k] = tokens[k] == PLAN_NONE ? NULL : plan.strings + tokens[k];
+        nstages += token[k] == NULL;
+    }
+    token[it->ntokens] = NULL;
+    token_count = it->ntokens;
+    background = it->background;
+
+    stage_count = 0;
+    if (nstages > 0)
+    {
+        if ((stages = arena_alloc(&line_arena, nstages * sizeof(*stages))) == NULL)
+            return false;
+        stages[stage_count++] = token;
+        for (uint32_t k = 0; k < it->ntokens; ++k)
+        {
+            if (token[k] == NULL)
+                stages[stage_count++] = &token[k + 1];
+        }
+    }
+
+    if (it->nredirs > redir_cap)
+    {
+        struct redirect *grown = realloc(redirs, it->nredirs * sizeof(*grown));
+        if (grown == NULL)
+            return false;
+        redirs = grown;
+        redir_cap = it->nredirs;
+    }
+    for (uint32_t k = 0; k < it->nredirs; ++k)
+    {
+        const struct plan_redirect *r = &plan.redirs[it->first_redir + k];
+        redirs[k] = (struct redirect){
+            .fd = r->fd,
+            .flags = r->flags,
+            .from = r->from,
+            .path = r->path == PLAN_NONE ? NULL : plan.strings + r->path,
+            .stage = r->stage,
+            .opened = -1,
+            .saved = -2,
+        };
+    }
+    redir_count = it->nredirs;
+    return true;
+}
+
+bool plan_write(FILE *f, const void *p, size_t n)
+{
+    return n == 0 || fwrite(p, n, 1, f) == 1;
+}
+
+// Write the plan out. It goes to a file of its own first and is renamed
+// into place, so a shell starting up at the same time sees either the old
+// plan or the new one
+void plan_save()
+{
+    // PATH's directories are always kept, so a script that changes PATH
+    // itself still has a plan that is up to date next time. It just has no
+    // commands in it
+    uint32_t ndirs = plan_count_dirs(plan.path), ncommands = 0;
+    size_t names_len = strlen(plan.path) + 1;
+    bool commands = plan_keeps_commands();
+    if (commands)
+    {
+        for (size_t i = 0; i < cmd_table_buckets; ++i)
+        {
+            for (struct hash_entry *e = cmd_table[i]; e != NULL; e = e->next)
+            {
+                ncommands++;
+                names_len += strlen(e->name) + 1 + strlen(e->path) + 1;
+            }
+        }
+    }
+    if (names_len >= UINT32_MAX)
+        return;
+
+    char *tmp;
+    if (asprintf(&tmp, "%s.%d", plan.file, (int)getpid()) == -1)
+        return;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+    if (f == NULL)
+    {
+        if (fd != -1)
+            close(fd);
+        free(tmp);
+        return;
+    }
+
+    struct plan_header h = {
+        .script_hash = plan.hash,
+        .script_size = plan.size,
+        .script_mtime = plan.mtime,
+        .script_ino = plan.ino,
+        .script_dev = plan.dev,
+        .nlines = plan.nlines,
+        .nitems = plan.nitems,
+        .ntokens = plan.ntokens,
+        .nredirs = plan.nredirs,
+        .strings_len = plan.strings_len,
+        .ndirs = ndirs,
+        .ncommands = ncommands,
+        .names_len = names_len,
+    };
+    memcpy(h.magic, PLAN_MAGIC, sizeof(h.magic));
+
+    bool ok = plan_write(f, &h, sizeof(h));
+    const char *d = plan.path;
+    for (uint32_t i = 0; ok && i < ndirs; ++i)
+    {
+        const char *end = strchr(d, ':');
+        size_t len = end ? (size_t)(end - d) : strlen(d);
+        int64_t mtime = plan_dir_mtime(d, len);
+        ok = plan_write(f, &mtime, sizeof(mtime));
+        d += len + 1;
+    }
+    ok = ok && plan_write(f, plan.lines, plan.nlines * sizeof(*plan.lines)) &&
+         plan_write(f, plan.items, plan.nitems * sizeof(*plan.items)) &&
+         plan_write(f, plan.redirs, plan.nredirs * sizeof(*plan.redirs)) &&
+         plan_write(f, plan.tokens, plan.ntokens * sizeof(*plan.tokens)) &&
+         plan_write(f, plan.strings, plan.strings_len) &&
+         plan_write(f, plan.path, strlen(plan.path) + 1);
+    for (size_t i = 0; ok && commands && i < cmd_table_buckets; ++i)
+    {
+        for (struct hash_entry *e = cmd_table[i]; ok && e != NULL; e = e->next)
+            ok = plan_write(f, e->name, strlen(e->name) + 1) && plan_write(f, e->path, strlen(e->path) + 1);
+    }
+
+    if (fclose(f) == EOF || !ok || rename(tmp, plan.file) == -1)
+        unlink(tmp);
+    free(tmp);
+}
+
+// Write the plan out if this run learned anything, and let go of it
+void close_plan()
+{
+    if (plan.enabled && (plan.dirty || (plan_keeps_commands() && cmd_table_count != plan.preloaded)))
+        plan_save();
+
+    if (plan.map != NULL)
+        munmap(plan.map, plan.maplen);
+    if (plan.owned)
+    {
+        free(plan.lines);
+        free(plan.items);
+        free(plan.tokens);
+        free(plan.redirs);
+        free(plan.strings);
+    }
+    free(plan.file);
+    free(plan.path);
+}
+
+/*
+ * Environment
+ *
+ * Variables live in a hash table of their own and every one of them is
+ * exported. Children get an envp built from the table the first time one is
+ * needed, and the same array is handed out again until some variable
+ * changes, so a script running thousands of commands builds it once instead
+ * of once per command. environ itself is left as it was at startup.
+ */
+#define ENV_TABLE_INITIAL_BUCKETS 64 // Must be a power of two
+
+struct env_var
+{
+    char *entry;        // "NAME=value", which is what goes into envp as is
+    size_t name_len;
+    struct env_var *next;
+};
+
+struct env_store
+{
+    struct env_var **table;
+    size_t buckets;
+    size_t count;
+
+    char **envp;        // NULL terminated, points at the entries
+    size_t envp_cap;
+    bool envp_stale;
+};
+
+struct env_store env = {0};
+
+// How long the name at the start of `s` is, 0 if there is none
+size_t env_name_len(const char *s)
+{
+    if (*s >= '0' && *s <= '9')
+        return 0;
+
+    size_t len = 0;
+    for (char c = s[len]; c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                          (c >= '0' && c <= '9'); c = s[++len])
+        ;
+    return len;
+}
+
+bool env_valid_name(const char *name, size_t len)
+{
+    return len > 0 && env_name_len(name) >= len;
+}
+
+// Where the variable is, or where it would go, so the caller can unlink it
+struct env_var **env_find(const char *name, size_t len)
+{
+    struct env_var **link = &env.table[hash_bytes(name, len) & (env.buckets - 1)];
+    for (; *link != NULL; link = &(*link)->next)
+    {
+        if ((*link)->name_len == len && !memcmp((*link)->entry, name, len))
+            break;
+    }
+    return link;
+}
+
+// The value of the variable `name` (which doesn't have to be terminated),
+// or NULL if it isn't set
+const char *env_lookup(const char *name, size_t len)
+{
+    if (env.table == NULL)
+        return NULL;
+
+    struct env_var *v = *env_find(name, len);
+    return v ? v->entry + v->name_len + 1 : NULL;
+}
+
+const char *env_get(const char *name)
+{
+    return env_lookup(name, strlen(name));
+}
+
+void env_changed(const char *name, size_t len)
+{
+    env.envp_stale = true;
+    if (len == 4 && !memcmp(name, "PATH", 4))
+        path_generation++;
+}
+
+// Same policy as the command table, double once there is one per bucket
+bool env_grow()
+{
+    if (env.count < env.buckets)
+        return true;
+
+    size_t buckets = env.buckets ? env.buckets * 2 : ENV_TABLE_INITIAL_BUCKETS;
+    struct env_var **table = calloc(buckets, sizeof(*table));
+    if (table == NULL)
+        return false;
+
+    for (size_t i = 0; i < env.buckets; ++i)
+    {
+        struct env_var *v = env.table[i];
+        while (v != NULL)
+        {
+            struct env_var *next = v->next;
+            size_t b = hash_bytes(v->entry, v->name_len) & (buckets - 1);
+            v->next = table[b];
+            table[b] = v;
+            v = next;
+        }
+    }
+
+    free(env.table);
+    env.table = table;
+    env.buckets = buckets;
+    return true;
+}
+
+bool env_set(const char *name, size_t len, const char *value)
+{
+    size_t value_len = strlen(value);
+    char *entry = malloc(len + 1 + value_len + 1);
+    if (entry == NULL || !env_grow())
+    {
+        free(entry);
+        return false;
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    struct env_var **link = env_find(name, len);
+    if (*link != NULL)
+    {
+        free((*link)->entry);
+        (*link)->entry = entry;
+    }
+    else
+    {
+        struct env_var *v = malloc(sizeof(*v));
+        if (v == NULL)
+        {
+            free(entry);
+            return false;
+        }
+        v->entry = entry;
+        v->name_len = len;
+        v->next = NULL;
+        *link = v;
+        env.count++;
+    }
+
+    env_changed(name, len);
+    return true;
+}
+
+void env_unset(const char *name)
+{
+    if (env.table == NULL)
+        return;
+
+    size_t len = strlen(name);
+    struct env_var **link = env_find(name, len);
+    if (*link == NULL)
+        return;
+
+    struct env_var *v = *link;
+    *link = v->next;
+    free(v->entry);
+    free(v);
+    env.count--;
+    env_changed(name, len);
+}
+
+// What to hand to execve, rebuilt only if something changed since last time
+char **env_envp()
+{
+    if (env.envp != NULL && !env.envp_stale)
+        return env.envp;
+
+    if (env.count + 1 > env.envp_cap)
+    {
+        size_t cap = env.count + 1 + 16;
+        char **grown = realloc(env.envp, cap * sizeof(*grown));
+        if (grown == NULL)
+            return environ;
+        env.envp = grown;
+        env.envp_cap = cap;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < env.buckets; ++i)
+    {
+        for (struct env_var *v = env.table[i]; v != NULL; v = v->next)
+            env.envp[n++] = v->entry;
+    }
+    env.envp[n] = NULL;
+    env.envp_stale = false;
+    return env.envp;
+}
+
+// Take over what we were started with. getenv finds the first of two
+// entries with the same name, so that is the one that is kept
+void init_env()
+{
+    for (char **e = environ; *e != NULL; ++e)
+    {
+        const char *eq = strchr(*e, '=');
+        if (eq == NULL || env_lookup(*e, eq - *e) != NULL)
+            continue;
+        if (!env_set(*e, eq - *e, eq + 1))
+        {
+            perror("msh");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+}
+
+void free_env()
+{
+    for (size_t i = 0; i < env.buckets; ++i)
+    {
+        struct env_var *v = env.table[i];
+        while (v != NULL)
+        {
+            struct env_var *next = v->next;
+            free(v->entry);
+            free(v);
+            v = next;
+        }
+    }
+    free(env.table);
+    free(env.envp);
+    memset(&env, 0, sizeof(env));
+}
+
+/*
+ * Command strings
+ *
+ * A history entry's command is shared rather than copied. Rerunning it with
+ * `!n` or `!!` gives the new entry another reference to the same string, so a
+ * script that replays the same command over and over never copies it, and a
+ * slot can be overwritten while the command it held is still running.
+ */
+struct cmd_str
+{
+    unsigned refs;
+    char text[];
+};
+
+struct cmd_str *cmd_header(char *cmd)
+{
+    return (struct cmd_str *)(cmd - offsetof(struct cmd_str, text));
+}
+
+// A new string with one reference, NULL if we are out of memory
+char *cmd_new(const char *s, size_t len)
+{
+    struct cmd_str *c = malloc(sizeof(*c) + len + 1);
+    if (c == NULL)
+        return NULL;
+
+    c->refs = 1;
+    memcpy(c->text, s, len);
+    c->text[len] = '\0';
+    return c->text;
+}
+
+char *cmd_ref(char *cmd)
+{
+    cmd_header(cmd)->refs++;
+    return cmd;
+}
+
+void cmd_unref(char *cmd)
+{
+    if (cmd != NULL && --cmd_header(cmd)->refs == 0)
+        free(cmd_header(cmd));
+}
+
+/*
+ * History log
+ *
+ * History is kept in an append-only file, one line per finished command:
+ *
+ *     time  pids  status  real_us  user_us  sys_us  maxrss_kb  command
+ *
+ * separated by tabs, with pids separated by commas or `-` for none. Every
+ * record goes out with a single O_APPEND write, so several shells can share
+ * the file without losing each other's entries and nothing has to be
+ * rewritten on exit. On startup the file is mmap'd and only its tail is
+ * looked at to fill the ring, so a huge history costs nothing until someone
+ * actually asks for all of it.
+ */
+#define HISTFILE_NAME ".msh_history"
+
+struct history_log
+{
+    int fd;           // -1 when there is no log
+    char *map;
+    size_t maplen;
+
+    // Offsets of the start of every complete record seen so far. Built on
+    // demand and extended as the file grows
+    size_t *offsets;
+    size_t count;
+    size_t cap;
+    size_t indexed;   // How far into the map the offsets go
+};
+
+struct history_log histlog = {.fd = -1};
+
+// Make the mapping cover everything currently in the file, which includes
+// whatever other shells appended since we last looked
+void histlog_remap()
+{
+    struct stat st;
+    if (histlog.fd == -1 || fstat(histlog.fd, &st) == -1 || (size_t)st.st_size <= histlog.maplen)
+        return;
+
+    if (histlog.map != NULL)
+        munmap(histlog.map, histlog.maplen);
+
+    histlog.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, histlog.fd, 0);
+    if (histlog.map == MAP_FAILED)
+    {
+        histlog.map = NULL;
+        histlog.maplen = 0;
+        return;
+    }
+    histlog.maplen = st.st_size;
+}
+
+// Bring the record index up to date. Only complete lines are indexed, so a
+// record some other shell is halfway through writing is picked up next time
+void histlog_index()
+{
+    histlog_remap();
+
+    while (histlog.indexed < histlog.maplen)
+    {
+        const char *start = histlog.map + histlog.indexed;
+        const char *nl = memchr(start, '\n', histlog.maplen - histlog.indexed);
+        if (nl == NULL)
+            break;
+
+        if (histlog.count == histlog.cap)
+        {
+            size_t cap = histlog.cap ? histlog.cap * 2 : 1024;
+            size_t *grown = realloc(histlog.offsets, cap * sizeof(*grown));
+            if (grown == NULL)
+                return;
+            histlog.offsets = grown;
+            histlog.cap = cap;
+        }
+
+        histlog.offsets[histlog.count++] = histlog.indexed;
+        histlog.indexed = nl + 1 - histlog.map;
+    }
+}
+
+// The command of a record, and its length. Records too mangled to have one
+// come back as an empty command
+const char *histlog_cmd(const char *rec, const char *end, size_t *len)
+{
+    const char *p = rec;
+    for (int field = 0; field < 7 && p != NULL; ++field)
+    {
+        p = memchr(p, '\t', end - p);
+        if (p != NULL)
+            p++;
+    }
+
+    if (p == NULL)
+        p = end;
+    *len = end - p;
+    return p;
+}
+
+// End of the record starting at `rec`, not counting its newline
+const char *histlog_end(const char *rec)
+{
+    return memchr(rec, '\n', histlog.map + histlog.maplen - rec);
+}
+
+// A decimal number from a record, which has to be followed by one of
+// `seps`. Leaves `*p` on the separator
+bool histlog_number(const char **p, const char *end, const char *seps, long long *value)
+{
+    const char *q = *p;
+    bool negative = q < end && *q == '-';
+    q += negative;
+
+    // Anything longer than this could overflow, and no field is that long
+    unsigned long long n = 0;
+    const char *digits = q;
+    for (; q < end && q - digits < 18 && *q >= '0' && *q <= '9'; ++q)
+        n = n * 10 + (*q - '0');
+    if (q == digits || q == end || strchr(seps, *q) == NULL)
+        return false;
+
+    *value = negative ? -(long long)n : (long long)n;
+    *p = q;
+    return true;
+}
+
+// Fill a ring slot from one record. Returns false, and leaves the slot as
+// it was, for a record that doesn't have every field or has no command
+bool histlog_load(struct command *entry, const char *rec, const char *end)
+{
+    const char *p = rec;
+    long long when, pid, fields[5];
+    if (!histlog_number(&p, end, "\t", &when))
+        return false;
+    p++;
+
+    // The pid list: either `-` or pids separated by commas
+    pid_t *pids = NULL;
+    size_t npids = 0;
+    if (p + 1 < end && p[0] == '-' && p[1] == '\t')
+        p++;
+    else
+    {
+        size_t n = 1;
+        for (const char *q = p; q < end && *q != '\t'; ++q)
+            n += *q == ',';
+
+        if ((pids = malloc(n * sizeof(*pids))) == NULL)
+            return false;
+        while (npids < n && histlog_number(&p, end, ",\t", &pid))
+        {
+            pids[npids++] = pid;
+            p += *p == ',';
+        }
+        if (npids < n || *p != '\t')
+        {
+            free(pids);
+            return false;
+        }
+    }
+    p++;
+
+    // status, real, user and sys time, and maxrss
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); ++i)
+    {
+        if (!histlog_number(&p, end, "\t", &fields[i]))
+        {
+            free(pids);
+            return false;
+        }
+        p++;
+    }
+
+    // And the command is the rest
+    if (p == end || (entry->cmd = cmd_new(p, end - p)) == NULL)
+    {
+        free(pids);
+        return false;
+    }
+    entry->seq = ++hist_seq;
+    entry->when = when;
+    entry->pids = pids;
+    entry->npids = npids;
+    entry->status = fields[0];
+    entry->wall_us = fields[1];
+    entry->user_us = fields[2];
+    entry->sys_us = fields[3];
+    entry->maxrss_kb = fields[4];
+    return true;
+}
+
+char *histlog_path()
+{
+    const char *path = getenv("MSH_HISTFILE");
+    if (path != NULL)
+        return *path ? strdup(path) : NULL;
+
+    const char *home = env_get("HOME");
+    if (home == NULL || *home == '\0')
+        return NULL;
+
+    char *full = malloc(strlen(home) + 1 + strlen(HISTFILE_NAME) + 1);
+    if (full != NULL)
+        sprintf(full, "%s/%s", home, HISTFILE_NAME);
+    return full;
+}
+
+// Open the log and fill the ring with its last HISTORY_SIZE records. Only
+// interactive shells keep history unless MSH_HISTFILE asks for it, and an
+// empty MSH_HISTFILE turns it off
+void init_history_log()
+{
+    if (!MSH_FEATURE_HISTLOG || (!interactive && getenv("MSH_HISTFILE") == NULL))
+        return;
+
+    char *path = histlog_path();
+    if (path == NULL)
+        return;
+
+    histlog.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    free(path);
+    if (histlog.fd == -1)
+        return;
+
+    histlog_remap();
+    if (histlog.map == NULL)
+        return;
+
+    // A shell that died half way through a record left it without its
+    // newline. End it here, or the next record would be glued on to it
+    if (histlog.maplen > 0 && histlog.map[histlog.maplen - 1] != '\n' &&
+        write(histlog.fd, "\n", 1) == -1)
+    {
+        close(histlog.fd);
+        histlog.fd = -1;
+        return;
+    }
+
+    // Walk back from the end a record at a time, ignoring a partial one
+    const char *end = histlog.map + histlog.maplen;
+    while (end > histlog.map && end[-1] != '\n')
+        end--;
+
+    const char *starts[HISTORY_SIZE];
+    int n = 0;
+    const char *p = end;
+    while (n < HISTORY_SIZE && p > histlog.map)
+    {
+        const char *rec = p - 1;
+        while (rec > histlog.map && rec[-1] != '\n')
+            rec--;
+        starts[n++] = rec;
+        p = rec;
+    }
+
+    // Mangled records are skipped, whatever wrote them
+    int loaded = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const char *rec = starts[n - 1 - i];
+        loaded += histlog_load(&history[loaded], rec, histlog_end(rec));
+    }
+    hist_ptr = loaded - 1;
+}
+
+void histlog_append(const struct command *entry)
+{
+    if (!MSH_FEATURE_HISTLOG || histlog.fd == -1 || entry->cmd == NULL)
+        return;
+
+    // It all goes out in one writev so that concurrent shells can't
+    // interleave their records. A parallel run can have any number of pids,
+    // so they get a buffer of their own
+    char head[32], tail[128];
+    int h = snprintf(head, sizeof(head), "%lld\t", (long long)entry->when);
+    int t = snprintf(tail, sizeof(tail), "\t%d\t%lld\t%lld\t%lld\t%ld\t", entry->status,
+                     entry->wall_us, entry->user_us, entry->sys_us, entry->maxrss_kb);
+    if (h < 0 || (size_t)h >= sizeof(head) || t < 0 || (size_t)t >= sizeof(tail))
+        return;
+
+    // Room for a comma and the longest pid there is, each
+    size_t pids_cap = entry->npids * 12 + 2, pids_len = 0;
+    char *pids = arena_alloc(&line_arena, pids_cap);
+    if (pids == NULL)
+        return;
+    for (size_t i = 0; i < entry->npids; ++i)
+    {
+        int n = snprintf(pids + pids_len, pids_cap - pids_len, i ? ",%d" : "%d", entry->pids[i]);
+        if (n < 0 || (size_t)n >= pids_cap - pids_len)
+            break;
+        pids_len += n;
+    }
+    if (pids_len == 0)
+        pids[pids_len++] = '-';
+
+    struct iovec iov[5] = {
+        {head, h},
+        {pids, pids_len},
+        {tail, t},
+        {entry->cmd, strlen(entry->cmd)},
+        {"\n", 1},
+    };
+    if (writev(histlog.fd, iov, 5) == -1)
+    {
+        // Don't nag on every command, just stop logging
+        perror("history");
+        close(histlog.fd);
+        histlog.fd = -1;
+    }
+}
+
+// history -a: every command in the log, numbered from the start of time
+void print_history_log()
+{
+    histlog_index();
+
+    for (size_t i = 0; i < histlog.count; ++i)
+    {
+        const char *rec = histlog.map + histlog.offsets[i];
+        size_t len;
+        const char *cmd = histlog_cmd(rec, histlog_end(rec), &len);
+        printf("[%5zu] %.*s\n", i, (int)len, cmd);
+    }
+}
+
+void close_history_log()
+{
+    if (histlog.map != NULL)
+        munmap(histlog.map, histlog.maplen);
+    if (histlog.fd != -1)
+        close(histlog.fd);
+    free(histlog.offsets);
+}
+
+/*
+ * History search
+ *
+ * Every record in the log is indexed by the trigrams (runs of three bytes)
+ * of its command. A substring search only has to look at the records in the
+ * posting list of the rarest trigram in the pattern, newest first, and
+ * check each of those for the real thing. Posting lists are kept in record
+ * order, so new records are just appended as the log grows and the index
+ * never has to be rebuilt.
+ */
+struct trigram_list
+{
+    uint32_t key;   // The three bytes plus one, 0 for an empty slot
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *ids;  // Record numbers, ascending
+};
+
+struct trigram_index
+{
+    struct trigram_list *slots;
+    size_t cap;      // Power of two
+    size_t used;
+    size_t indexed;  // Records of the log that are in the index
+};
+
+struct trigram_index trigrams = {0};
+
+uint32_t trigram_key(const char *p)
+{
+    return (((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) |
+            (unsigned char)p[2]) + 1;
+}
+
+struct trigram_list *trigram_find(uint32_t key, bool create)
+{
+    if (trigrams.cap == 0 || (create && trigrams.used * 2 >= trigrams.cap))
+    {
+        if (!create)
+            return NULL;
+
+        // Grow and rehash, linear probing wants to stay at most half full
+        size_t cap = trigrams.cap ? trigrams.cap * 2 : 4096;
+        struct trigram_list *slots = calloc(cap, sizeof(*slots));
+        if (slots == NULL)
+            return NULL;
+
+        for (size_t i = 0; i < trigrams.cap; ++i)
+        {
+            if (trigrams.slots[i].key == 0)
+                continue;
+
+            size_t j = (trigrams.slots[i].key * 2654435761u) & (cap - 1);
+            while (slots[j].key != 0)
+                j = (j + 1) & (cap - 1);
+            slots[j] = trigrams.slots[i];
+        }
+
+        free(trigrams.slots);
+        trigrams.slots = slots;
+        trigrams.cap = cap;
+    }
+
+    size_t i = (key * 2654435761u) & (trigrams.cap - 1);
+    while (trigrams.slots[i].key != 0)
+    {
+        if (trigrams.slots[i].key == key)
+            return &trigrams.slots[i];
+        i = (i + 1) & (trigrams.cap - 1);
+    }
+
+    if (!create)
+        return NULL;
+
+    trigrams.slots[i].key = key;
+    trigrams.used++;
+    return &trigrams.slots[i];
+}
+
+// The command of record `id` as a pointer into the log plus a length
+const char *histlog_command(size_t id, size_t *len)
+{
+    const char *rec = histlog.map + histlog.offsets[id];
+    return histlog_cmd(rec, histlog_end(rec), len);
+}
+
+// Index whatever records were added to the log since last time
+void trigram_update()
+{
+    histlog_index();
+
+    for (; trigrams.indexed < histlog.count; ++trigrams.indexed)
+    {
+        uint32_t id = trigrams.indexed;
+        size_t len;
+        const char *cmd = histlog_command(id, &len);
+
+        for (size_t i = 0; i + 3 <= len; ++i)
+        {
+            struct trigram_list *list = trigram_find(trigram_key(cmd + i), true);
+            if (list == NULL)
+                return;
+
+            // The same trigram twice in one command only counts once
+            if (list->count > 0 && list->ids[list->count - 1] == id)
+                continue;
+
+            if (list->count == list->cap)
+            {
+                uint32_t cap = list->cap ? list->cap * 2 : 4;
+                uint32_t *ids = realloc(list->ids, cap * sizeof(*ids));
+                if (ids == NULL)
+                    return;
+                list->ids = ids;
+                list->cap = cap;
+            }
+            list->ids[list->count++] = id;
+        }
+    }
+}
+
+bool history_matches(const char *cmd, size_t len, const char *pat, size_t patlen, bool prefix)
+{
+    if (prefix)
+        return len >= patlen && !memcmp(cmd, pat, patlen);
+    return memmem(cmd, len, pat, patlen) != NULL;
+}
+
+// The newest record before record `before` whose command contains `pat`, or
+// starts with it if `prefix` is set. Returns -1 if there is none. Patterns
+// shorter than a trigram have to fall back to looking at every record, but
+// those are also the ones most likely to match something recent
+ssize_t history_search(const char *pat, size_t before, bool prefix)
+{
+    trigram_update();
+
+    size_t patlen = strlen(pat);
+    if (before > histlog.count)
+        before = histlog.count;
+
+    if (patlen < 3)
+    {
+        for (size_t id = before; id-- > 0;)
+        {
+            size_t len;
+            const char *cmd = histlog_command(id, &len);
+            if (history_matches(cmd, len, pat, patlen, prefix))
+                return id;
+        }
+        return -1;
+    }
+
+    // Every match has to be in the list of every trigram of the pattern, so
+    // the shortest list is all we need to look at. For a prefix only the
+    // first trigram has a known position, but it is still a fine filter
+    struct trigram_list *best = NULL;
+    for (size_t i = 0; i + 3 <= patlen; ++i)
+    {
+        struct trigram_list *list = trigram_find(trigram_key(pat + i), false);
+        if (list == NULL)
+            return -1;
+        if (best == NULL || list->count < best->count)
+            best = list;
+    }
+
+    // Skip straight to the records before `before`, then walk back from there
+    size_t lo = 0, hi = best->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (best->ids[mid] < before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    while (lo-- > 0)
+    {
+        size_t len;
+        const char *cmd = histlog_command(best->ids[lo], &len);
+        if (history_matches(cmd, len, pat, patlen, prefix))
+            return best->ids[lo];
+    }
+    return -1;
+}
+
+// history -s: every command that contains `pat`, oldest first. Without a log
+// all there is to look through is the ring
+void print_history_search(const char *pat)
+{
+    if (histlog.fd == -1)
+    {
+        int first = 0, count = hist_ptr + 1;
+        if (hist_ptr != HISTORY_SIZE - 1 && history[hist_ptr + 1].cmd != NULL)
+        {
+            first = hist_ptr + 1;
+            count = HISTORY_SIZE;
+        }
+
+        for (int i = first, j = 0; j < count; ++i, ++j)
+        {
+            if (i == HISTORY_SIZE)
+                i = 0;
+            if (strstr(history[i].cmd, pat) != NULL)
+                printf("[%2d] %s\n", j, history[i].cmd);
+        }
+        return;
+    }
+
+    // Collect newest first through the index, then print them the other way
+    size_t n = 0, cap = 0;
+    size_t *ids = NULL;
+    for (ssize_t id = history_search(pat, SIZE_MAX, false); id != -1;
+         id = history_search(pat, id, false))
+    {
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            size_t *grown = realloc(ids, cap * sizeof(*ids));
+            if (grown == NULL)
+                break;
+            ids = grown;
+        }
+        ids[n++] = id;
+    }
+
+    while (n-- > 0)
+    {
+        size_t len;
+        const char *cmd = histlog_command(ids[n], &len);
+        printf("[%5zu] %.*s\n", ids[n], (int)len, cmd);
+    }
+    free(ids);
+}
+
+// !prefix: the newest command that starts with `prefix`, as a command string
+// the caller holds a reference to, or NULL if there is none
+char *history_find_prefix(const char *prefix)
+{
+    if (histlog.fd == -1)
+    {
+        size_t n = strlen(prefix);
+        for (int j = 0, i = hist_ptr; j < HISTORY_SIZE && i >= 0 && history[i].cmd; ++j)
+        {
+            if (!strncmp(history[i].cmd, prefix, n))
+                return cmd_ref(history[i].cmd);
+            i = i == 0 ? HISTORY_SIZE - 1 : i - 1;
+        }
+        return NULL;
+    }
+
+    ssize_t id = history_search(prefix, SIZE_MAX, true);
+    if (id == -1)
+        return NULL;
+
+    size_t len;
+    const char *cmd = histlog_command(id, &len);
+    return cmd_new(cmd, len);
+}
+
+void free_trigrams()
+{
+    for (size_t i = 0; i < trigrams.cap; ++i)
+        free(trigrams.slots[i].ids);
+    free(trigrams.slots);
+}
+
+/*
+ * Directory cache
+ *
+ * Completion wants the names in a directory every time tab is pressed, and
+ * reading /usr/bin over NFS each time is what makes that slow. Listings are
+ * read with getdents64 into one large buffer, sorted once, and kept per
+ * directory until its mtime changes. They are keyed by device and inode, so
+ * it doesn't matter what name the directory was reached by or where we are.
+ *
+ * The mtime only has so much resolution. A directory that was changed in
+ * the same second we read it might change again without the mtime moving,
+ * so such a listing is read again next time instead of trusted.
+ */
+#define DIRCACHE_READ_SIZE (32 * 1024)
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dircache_entry
+{
+    size_t name;        // Offset into names
+    unsigned char type; // d_type, which can be DT_UNKNOWN
+};
+
+struct dircache
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;
+    unsigned long epoch; // The last lookup this listing was checked in
+
+    char *names;
+    size_t names_len, names_cap;
+    struct dircache_entry *entries; // Sorted by name
+    size_t count, cap;
+
+    struct dircache *next;
+};
+
+struct dircache *dircaches = NULL;
+
+// Every completion is one lookup. A listing that was checked during this one
+// is used as it is, so pointers into it stay good until the next
+unsigned long dircache_epoch = 0;
+
+int dircache_compare(const void *a, const void *b, void *names)
+{
+    return strcmp((char *)names + ((const struct dircache_entry *)a)->name,
+                  (char *)names + ((const struct dircache_entry *)b)->name);
+}
+
+// Replace the listing with what is in the directory now
+bool dircache_read(struct dircache *dc, int fd)
+{
+    char *buf = malloc(DIRCACHE_READ_SIZE);
+    if (buf == NULL)
+        return false;
+
+    dc->names_len = 0;
+    dc->count = 0;
+
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, DIRCACHE_READ_SIZE)) > 0)
+    {
+        for (long off = 0; off < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            size_t len = strlen(name) + 1;
+            if (dc->names_len + len > dc->names_cap)
+            {
+                size_t cap = dc->names_cap ? dc->names_cap * 2 : 4096;
+                while (cap < dc->names_len + len)
+                    cap *= 2;
+                char *grown = realloc(dc->names, cap);
+                if (grown == NULL)
+                    goto fail;
+                dc->names = grown;
+                dc->names_cap = cap;
+            }
+            if (dc->count == dc->cap)
+            {
+                size_t cap = dc->cap ? dc->cap * 2 : 256;
+                struct dircache_entry *grown = realloc(dc->entries, cap * sizeof(*grown));
+                if (grown == NULL)
+                    goto fail;
+                dc->entries = grown;
+                dc->cap = cap;
+            }
+
+            memcpy(dc->names + dc->names_len, name, len);
+            dc->entries[dc->count].name = dc->names_len;
+            dc->entries[dc->count].type = d->d_type;
+            dc->count++;
+            dc->names_len += len;
+        }
+    }
+    free(buf);
+
+    if (n < 0)
+    {
+        dc->count = 0;
+        return false;
+    }
+
+    // An empty directory never got an entries array at all
+    if (dc->count > 1)
+        qsort_r(dc->entries, dc->count, sizeof(*dc->entries), dircache_compare, dc->names);
+    return true;
+
+fail:
+    free(buf);
+    dc->count = 0;
+    return false;
+}
+
+// The listing for `path`, read again only if the directory changed. NULL if
+// it can't be read
+struct dircache *dircache_get(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    struct dircache *dc = dircaches;
+    while (dc != NULL && (dc->dev != st.st_dev || dc->ino != st.st_ino))
+        dc = dc->next;
+
+    if (dc != NULL)
+    {
+        if (dc->epoch == dircache_epoch ||
+            (!dc->racy && dc->mtime.tv_sec == st.st_mtim.tv_sec &&
+             dc->mtime.tv_nsec == st.st_mtim.tv_nsec))
+        {
+            dc->epoch = dircache_epoch;
+            return dc;
+        }
+    }
+    else
+    {
+        if ((dc = calloc(1, sizeof(*dc))) == NULL)
+            return NULL;
+        dc->dev = st.st_dev;
+        dc->ino = st.st_ino;
+        dc->next = dircaches;
+        dircaches = dc;
+    }
+
+    // The mtime that counts is the one from before the names were read, so
+    // a change while we read still shows up next time
+    int fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        dc->count = 0;
+        dc->racy = true;
+        return NULL;
+    }
+
+    dc->mtime = st.st_mtim;
+    dc->racy = st.st_mtim.tv_sec >= time(NULL) - 1;
+    dc->epoch = dircache_epoch;
+    bool ok = dircache_read(dc, fd);
+    close(fd);
+
+    if (!ok)
+    {
+        dc->racy = true;
+        return NULL;
+    }
+    return dc;
+}
+
+const char *dircache_name(const struct dircache *dc, size_t i)
+{
+    return dc->names + dc->entries[i].name;
+}
+
+// Index of the first name that starts with `prefix`, the ones after it that
+// also do follow it directly since the names are sorted
+size_t dircache_find(const struct dircache *dc, const char *prefix, size_t len)
+{
+    size_t lo = 0, hi = dc->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(dircache_name(dc, mid), prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void free_dircaches()
+{
+    while (dircaches != NULL)
+    {
+        struct dircache *next = dircaches->next;
+        free(dircaches->names);
+        free(dircaches->entries);
+        free(dircaches);
+        dircaches = next;
+    }
+}
+
+/*
+ * Globbing
+ *
+ * A word with an unquoted `*`, `?` or `[...]` in it is replaced by the
+ * paths it matches, in sorted order, or left as it is if nothing matches.
+ * The pattern is matched one path component at a time. Only components that
+ * are patterns need their directory listed, and the listing comes from the
+ * directory cache. Each listing is checked against its directory's mtime at
+ * most once per command line, so `a/x/b/y.c` with patterns in it reads
+ * every directory it goes through once, however many words it matches.
+ */
+struct word_buf glob_path = {0};
+
+// Whether the first `len` bytes of a pattern have anything special to
+// fnmatch in them. A `[` only counts if a `]` comes after it
+bool glob_special(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (s[i] == '\\' && i + 1 < len)
+            i++;
+        else if (s[i] == '*' || s[i] == '?')
+            return true;
+        else if (s[i] == '[' && memchr(s + i + 1, ']', len - i - 1) != NULL)
+            return true;
+    }
+    return false;
+}
+
+bool glob_found()
+{
+    char *match = arena_alloc(&line_arena, glob_path.len + 1);
+    if (match == NULL)
+        return false;
+    memcpy(match, glob_path.buf, glob_path.len);
+    match[glob_path.len] = '\0';
+    return push_token(match);
+}
+
+// Match `pattern` against what is under glob_path, which is a directory
+// (empty for the current one), and push every path that matches. `*found`
+// counts them
+bool glob_walk(const char *pattern, size_t *found)
+{
+    size_t base = glob_path.len;
+    size_t slashes = strspn(pattern, "/");
+    if (!word_append(&glob_path, pattern, slashes))
+        return false;
+    pattern += slashes;
+
+    if (*pattern == '\0')
+    {
+        // Only reached through names we listed or checked, so it exists
+        bool ok = glob_found();
+        (*found)++;
+        glob_path.len = base;
+        return ok;
+    }
+
+    size_t len = strcspn(pattern, "/");
+    const char *rest = pattern + len;
+    bool ok = true;
+
+    if (!glob_special(pattern, len))
+    {
+        // Nothing to list, a plain name is just checked for at the end
+        for (size_t i = 0; ok && i < len; ++i)
+        {
+            if (pattern[i] == '\\' && i + 1 < len)
+                i++;
+            ok = word_append(&glob_path, pattern + i, 1);
+        }
+        glob_path.buf[glob_path.len] = '\0';
+
+        struct stat st;
+        if (ok && (*rest != '\0' || lstat(glob_path.buf, &st) == 0))
+            ok = glob_walk(rest, found);
+        glob_path.len = base;
+        return ok;
+    }
+
+    char *component = arena_alloc(&line_arena, len + 1);
+    if (component == NULL)
+        return false;
+    memcpy(component, pattern, len);
+    component[len] = '\0';
+
+    glob_path.buf[glob_path.len] = '\0';
+    size_t dir_len = glob_path.len;
+    struct dircache *dc = dircache_get(dir_len ? glob_path.buf : ".");
+    if (dc == NULL)
+    {
+        glob_path.len = base;
+        return true;
+    }
+
+    // Only the names that start with the pattern's plain prefix can match
+    size_t prefix = strcspn(component, "*?[\\");
+    for (size_t i = dircache_find(dc, component, prefix); ok && i < dc->count; ++i)
+    {
+        const char *name = dircache_name(dc, i);
+        if (strncmp(name, component, prefix) != 0)
+            break;
+        if (fnmatch(component, name, FNM_PERIOD) != 0)
+            continue;
+
+        // Anything with more pattern after it has to be a directory
+        unsigned char type = dc->entries[i].type;
+        if (*rest != '\0' && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+            continue;
+
+        glob_path.len = dir_len;
+        ok = word_append(&glob_path, name, strlen(name)) && glob_walk(rest, found);
+    }
+    glob_path.len = base;
+    return ok;
+}
+
+// Push `word`, or what it matches if `pattern` is a glob that matches
+// anything
+bool push_glob(char *word, const char *pattern)
+{
+    if (pattern == NULL || !glob_special(pattern, strlen(pattern)))
+        return push_token(word);
+
+    size_t found = 0;
+    glob_path.len = 0;
+    if (!glob_walk(pattern, &found))
+        return false;
+    return found > 0 || push_token(word);
+}
+
+/*
+ * Completion
+ *
+ * The first word of a pipeline stage is completed as a command: builtins,
+ * whatever the command hash table already knows, then the contents of every
+ * PATH directory. Any other word, or one with a slash in it, is completed
+ * as a path.
+ */
+
+// The builtins are further down with run_builtin
+struct builtin
+{
+    const char *name;
+    int (*run)(int argc, char **argv);
+};
+
+extern const struct builtin builtins[];
+extern const size_t builtin_count;
+
+// Handled by the main loop and run_list rather than by run_builtin, but
+// just as much something to type
+const char *completion_extras[] = {"exit", "quit"};
+
+struct completions
+{
+    const char **names;
+    size_t count, cap;
+
+    // Set for a single match that names a directory
+    bool dir;
+};
+
+void completions_add(struct completions *c, const char *name)
+{
+    if (c->count == c->cap)
+    {
+        size_t cap = c->cap ? c->cap * 2 : 64;
+        const char **grown = realloc(c->names, cap * sizeof(*grown));
+        if (grown == NULL)
+            return;
+        c->names = grown;
+        c->cap = cap;
+    }
+    c->names[c->count++] = name;
+}
+
+int completions_compare(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Everything in `dir` that starts with `prefix`. Dot files only show up when
+// the prefix asks for them, and commands have to be something we can run
+void complete_in_dir(struct completions *c, const char *dir, const char *prefix,
+                     size_t len, bool commands)
+{
+    struct dircache *dc = dircache_get(dir);
+    if (dc == NULL)
+        return;
+
+    // The exec bit is only looked at for the names that match, so the
+    // listing itself can stay cached
+    int dirfd = commands ? open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (commands && dirfd == -1)
+        return;
+
+    for (size_t i = dircache_find(dc, prefix, len); i < dc->count; ++i)
+    {
+        const char *name = dircache_name(dc, i);
+        if (strncmp(name, prefix, len))
+            break;
+        if (name[0] == '.' && prefix[0] != '.')
+            continue;
+        if (commands && (dc->entries[i].type == DT_DIR || faccessat(dirfd, name, X_OK, 0) == -1))
+            continue;
+        completions_add(c, name);
+    }
+    if (dirfd != -1)
+        close(dirfd);
+}
+
+// Find what `word` can be completed to. The names are sorted, unique and
+// only good until the next call
+void complete_word(struct completions *c, const char *word, size_t len, bool command)
+{
+    c->count = 0;
+    c->dir = false;
+    dircache_epoch++;
+
+    const char *slash = memrchr(word, '/', len);
+    if (command && slash == NULL)
+    {
+        char *prefix = strndup(word, len);
+        if (prefix == NULL)
+            return;
+
+        for (size_t i = 0; i < builtin_count; ++i)
+        {
+            if (!strncmp(builtins[i].name, prefix, len))
+                completions_add(c, builtins[i].name);
+        }
+        for (size_t i = 0; i < sizeof(completion_extras) / sizeof(*completion_extras); ++i)
+        {
+            if (!strncmp(completion_extras[i], prefix, len))
+                completions_add(c, completion_extras[i]);
+        }
+
+        hash_check_path();
+        for (size_t i = 0; i < cmd_table_buckets; ++i)
+        {
+            for (struct hash_entry *e = cmd_table[i]; e != NULL; e = e->next)
+            {
+                if (!strncmp(e->name, prefix, len))
+                    completions_add(c, e->name);
+            }
+        }
+
+        for (const char *dirs = cmd_table_path; dirs != NULL;)
+        {
+            const char *end = strchr(dirs, ':');
+            size_t dir_len = end ? (size_t)(end - dirs) : strlen(dirs);
+
+            // An empty PATH element means the current directory
+            char *dir = dir_len == 0 ? strdup(".") : strndup(dirs, dir_len);
+            if (dir != NULL)
+                complete_in_dir(c, dir, prefix, len, true);
+            free(dir);
+            dirs = end ? end + 1 : NULL;
+        }
+        free(prefix);
+    }
+    else
+    {
+        // Split into the directory to look in and the name to complete
+        size_t dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+        char *dir = dir_len == 0 ? strdup(".") : strndup(word, dir_len);
+        char *base = strndup(word + dir_len, len - dir_len);
+        if (dir != NULL && base != NULL)
+            complete_in_dir(c, dir, base, len - dir_len, false);
+
+        // The one match gets a slash if it is a directory. d_type can't be
+        // trusted for symlinks, and some filesystems don't fill it in at all
+        char *path;
+        if (c->count == 1 && dir != NULL && asprintf(&path, "%s/%s", dir, c->names[0]) != -1)
+        {
+            struct stat st;
+            c->dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+            free(path);
+        }
+        free(dir);
+        free(base);
+    }
+
+    // The same command can be in more than one place
+    if (c->count > 1)
+    {
+        qsort(c->names, c->count, sizeof(*c->names), completions_compare);
+
+        size_t n = 1;
+        for (size_t i = 1; i < c->count; ++i)
+        {
+            if (strcmp(c->names[i], c->names[n - 1]))
+                c->names[n++] = c->names[i];
+        }
+        c->count = n;
+    }
+}
+
+void free_completions(struct completions *c)
+{
+    free(c->names);
+    c->names = NULL;
+    c->count = c->cap = 0;
+}
+
+/*
+ * Line editor
+ *
+ * At a terminal the line is read in raw mode, so there is cursor movement
+ * and Up/Down walk through history. Every read() takes the whole burst of
+ * keys the terminal had for us, all of it is applied to the line, and only
+ * then is the screen updated. The update rewrites just the part of the line
+ * that changed, with one write(), so typing over a slow link costs a few
+ * bytes per key instead of the whole prompt and line.
+ *
+ * The terminal is back in its normal mode by the time a line is returned,
+ * so commands never see raw mode, and typing a line and pressing enter
+ * echoes exactly what the terminal itself would have.
+ *
+ * A line wider than the terminal scrolls sideways instead of wrapping, so
+ * what is on the screen is always one row: the prompt, then as much of the
+ * line around the cursor as fits. The width is taken again for every line
+ * and whenever the terminal says it was resized.
+ *
+ * Keys: Left/Right, Home/End (also Ctrl-A/Ctrl-E), Backspace, Delete,
+ * Ctrl-D (end of input on an empty line), Ctrl-K, Ctrl-U, Ctrl-W, Ctrl-L,
+ * Up/Down (also Ctrl-P/Ctrl-N), Ctrl-R for reverse history search, Tab
+ * for completion and Ctrl-C to throw the line away.
+ */
+#define EDITOR_INPUT_SIZE 4096
+#define EDITOR_SEARCH_MAX 256
+#define EDITOR_LIST_MAX 256 // More completions than this are only counted
+
+struct line_editor
+{
+    bool enabled;           // stdin is a terminal we get to drive
+    struct termios cooked;  // How the terminal was, put back after each line
+    const char *prompt;
+
+    // The line being edited, and the cursor in it
+    char *buf;
+    size_t len, pos, cap;
+
+    // What the terminal is showing after the prompt, and where its cursor
+    // is. Comparing this to buf is how we know what to redraw
+    char *shown;
+    size_t shown_len, scr, shown_cap;
+
+    // Terminal width, how much of it the prompt takes, and the offset into
+    // buf of the first byte on the screen
+    size_t cols, prompt_cols, off;
+
+    // Keys that came in after the end of the last line
+    unsigned char in[EDITOR_INPUT_SIZE];
+    size_t in_start, in_end;
+    int esc;                // How far into an escape sequence we are
+    unsigned esc_arg;
+
+    // Everything for the terminal piles up here and goes out in one write
+    char *out;
+    size_t out_len, out_cap;
+
+    // History browsing. `back` is how many commands back from the newest
+    // we are, 0 is the line that was being typed, which is kept in saved
+    size_t hist_count, back;
+    char *saved;
+    size_t saved_cap;
+
+    // Reverse search
+    bool searching;
+    char search[EDITOR_SEARCH_MAX];
+    size_t search_len;
+    size_t search_back;     // Entry the current match is in, 0 if none
+
+    unsigned tabs;          // Tabs in a row, the second one lists matches
+    struct completions completion;
+};
+
+struct line_editor editor = {0};
+
+volatile sig_atomic_t editor_resized = 0;
+
+void on_sigwinch(int sig)
+{
+    (void)sig;
+    editor_resized = 1;
+}
+
+// Set up with the job table further down. Reads go through JOB_CONTROL so
+// that builds without it lose all the process group handling
+extern bool job_control;
+#define JOB_CONTROL (MSH_FEATURE_JOB_CONTROL && job_control)
+
+void editor_init()
+{
+    const char *term = getenv("TERM");
+    editor.enabled = MSH_FEATURE_EDITOR && interactive && input.fd == STDIN_FILENO &&
+                     tcgetattr(STDIN_FILENO, &editor.cooked) == 0 &&
+                     (term == NULL || strcmp(term, "dumb"));
+
+    // No SA_RESTART, a resize has to wake up the wait for keys. That is
+    // the only place it isn't blocked
+    if (editor.enabled)
+    {
+        struct sigaction sa = {0};
+        sa.sa_handler = on_sigwinch;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGWINCH, &sa, NULL);
+    }
+}
+
+// Find out how wide the terminal is now
+void editor_size()
+{
+    struct winsize ws;
+    editor_resized = 0;
+    editor.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+}
+
+void editor_free()
+{
+    free(editor.buf);
+    free(editor.shown);
+    free(editor.out);
+    free(editor.saved);
+    free_completions(&editor.completion);
+    free_dircaches();
+}
+
+bool editor_grow(char **buf, size_t *cap, size_t need)
+{
+    if (need <= *cap)
+        return true;
+
+    size_t n = *cap ? *cap : 128;
+    while (n < need)
+        n *= 2;
+
+    char *grown = realloc(*buf, n);
+    if (grown == NULL)
+        return false;
+    *buf = grown;
+    *cap = n;
+    return true;
+}
+
+void editor_emit(const char *s, size_t n)
+{
+    if (!editor_grow(&editor.out, &editor.out_cap, editor.out_len + n))
+        return;
+    memcpy(editor.out + editor.out_len, s, n);
+    editor.out_len += n;
+}
+
+void editor_flush()
+{
+    size_t done = 0;
+    while (done < editor.out_len)
+    {
+        ssize_t n = write(STDOUT_FILENO, editor.out + done, editor.out_len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    editor.out_len = 0;
+}
+
+// Character boundaries either side of `pos`
+size_t editor_prev(size_t pos)
+{
+    while (pos > 0 && (editor.buf[--pos] & 0xC0) == 0x80)
+        ;
+    return pos;
+}
+
+size_t editor_next(size_t pos)
+{
+    while (pos < editor.len && (editor.buf[++pos] & 0xC0) == 0x80)
+        ;
+    return pos < editor.len ? pos : editor.len;
+}
+
+// Screen columns taken up by n bytes of UTF-8, continuation bytes take none
+size_t editor_columns(const char *s, size_t n)
+{
+    size_t cols = 0;
+    for (size_t i = 0; i < n; ++i)
+        cols += (s[i] & 0xC0) != 0x80;
+    return cols;
+}
+
+// Move the terminal's cursor between two offsets into what it is showing.
+// Short moves are cheaper as backspaces or by writing the same text again
+// than as escape sequences
+void editor_move(size_t from, size_t to)
+{
+    char seq[32];
+
+    if (to < from)
+    {
+        size_t cols = editor_columns(editor.shown + to, from - to);
+        if (cols <= 4)
+            editor_emit("\b\b\b\b", cols);
+        else
+            editor_emit(seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", cols));
+    }
+    else if (to > from)
+    {
+        if (to - from <= 8)
+            editor_emit(editor.shown + from, to - from);
+        else
+            editor_emit(seq, snprintf(seq, sizeof(seq), "\x1b[%zuC",
+                                      editor_columns(editor.shown + from, to - from)));
+    }
+}
+
+// Scroll the line so that the cursor is on the screen, and return how many
+// bytes from editor.off fit. The last column is left alone, so the cursor
+// never wraps to the next row even at the end of the line
+size_t editor_scroll()
+{
+    size_t width = editor.cols > editor.prompt_cols + 1 ? editor.cols - editor.prompt_cols - 1 : 1;
+
+    if (editor_columns(editor.buf, editor.len) <= width)
+        editor.off = 0;
+    else
+    {
+        // Off the screen it goes to the middle, so the next few keys
+        // don't have to scroll again
+        if (editor.pos < editor.off || editor_columns(editor.buf + editor.off, editor.pos - editor.off) > width)
+        {
+            editor.off = editor.pos;
+            for (size_t cols = 0; editor.off > 0 && cols < width / 2; ++cols)
+                editor.off = editor_prev(editor.off);
+        }
+
+        // And nothing is left blank at the end while there is more to the left
+        size_t cols = editor_columns(editor.buf + editor.off, editor.len - editor.off);
+        for (; editor.off > 0 && cols < width; ++cols)
+            editor.off = editor_prev(editor.off);
+    }
+
+    size_t end = editor.off;
+    for (size_t cols = 0; end < editor.len && cols < width; ++cols)
+        end = editor_next(end);
+    return end - editor.off;
+}
+
+// Bring the terminal in line with the buffer, rewriting only from the first
+// byte that differs
+void editor_refresh()
+{
+    size_t len = editor_scroll();
+    const char *want = editor.buf + editor.off;
+    size_t pos = editor.pos - editor.off;
+
+    size_t d = 0;
+    size_t common = len < editor.shown_len ? len : editor.shown_len;
+    while (d < common && want[d] == editor.shown[d])
+        d++;
+
+    // Never start redrawing in the middle of a character
+    while (d > 0 && ((d < len && (want[d] & 0xC0) == 0x80) ||
+                     (d < editor.shown_len && (editor.shown[d] & 0xC0) == 0x80)))
+        d--;
+
+    if (d == len && d == editor.shown_len)
+    {
+        editor_move(editor.scr, pos);
+        editor.scr = pos;
+        return;
+    }
+
+    if (!editor_grow(&editor.shown, &editor.shown_cap, len + 1))
+        return;
+
+    editor_move(editor.scr, d);
+    editor_emit(want + d, len - d);
+    if (editor_columns(editor.shown + d, editor.shown_len - d) > editor_columns(want + d, len - d))
+        editor_emit("\x1b[K", 3);
+
+    memcpy(editor.shown + d, want + d, len - d);
+    editor.shown_len = len;
+    editor.scr = len;
+
+    editor_move(editor.scr, pos);
+    editor.scr = pos;
+}
+
+// Draw the whole line again, after the prompt changed or the screen went
+void editor_redraw()
+{
+    editor_emit("\r", 1);
+    if (editor.searching)
+    {
+        char head[EDITOR_SEARCH_MAX + 32];
+        int n = snprintf(head, sizeof(head), "(%sreverse-i-search)`%.*s': ",
+                         editor.search_len > 0 && editor.search_back == 0 ? "failing " : "",
+                         (int)editor.search_len, editor.search);
+        editor_emit(head, n);
+        editor.prompt_cols = editor_columns(head, n);
+    }
+    else
+    {
+        editor_emit(editor.prompt, strlen(editor.prompt));
+        editor.prompt_cols = editor_columns(editor.prompt, strlen(editor.prompt));
+    }
+
+    editor.shown_len = editor.scr = 0;
+    editor_emit("\x1b[K", 3);
+    editor_refresh();
+}
+
+void editor_set(const char *s, size_t n, size_t pos)
+{
+    if (!editor_grow(&editor.buf, &editor.cap, n + 1))
+        return;
+    memmove(editor.buf, s, n);
+    editor.len = n;
+    editor.pos = pos;
+}
+
+void editor_insert(char c)
+{
+    if (!editor_grow(&editor.buf, &editor.cap, editor.len + 2))
+        return;
+    memmove(editor.buf + editor.pos + 1, editor.buf + editor.pos, editor.len - editor.pos);
+    editor.buf[editor.pos++] = c;
+    editor.len++;
+}
+
+// Drop the bytes between two offsets, from <= to
+void editor_delete(size_t from, size_t to)
+{
+    memmove(editor.buf + from, editor.buf + to, editor.len - to);
+    editor.len -= to - from;
+    editor.pos = from;
+}
+
+/* History as the editor sees it */
+
+// The log when there is one, the ring otherwise. `back` is 1 for the newest
+// command. The log can be remapped by the next call, so whatever comes back
+// has to be copied right away
+const char *editor_history(size_t back, size_t *len)
+{
+    if (histlog.fd != -1)
+        return histlog_command(editor.hist_count - back, len);
+
+    int i = hist_ptr - (int)(back - 1);
+    if (i < 0)
+        i += HISTORY_SIZE;
+    *len = strlen(history[i].cmd);
+    return history[i].cmd;
+}
+
+// The newest command at least `back` commands back that contains the
+// search pattern, 0 if there is none
+size_t editor_history_find(size_t back)
+{
+    if (back > editor.hist_count)
+        return 0;
+
+    if (histlog.fd != -1)
+    {
+        char pat[EDITOR_SEARCH_MAX + 1];
+        memcpy(pat, editor.search, editor.search_len);
+        pat[editor.search_len] = '\0';
+
+        ssize_t id = history_search(pat, editor.hist_count - back + 1, false);
+        return id == -1 ? 0 : editor.hist_count - id;
+    }
+
+    for (; back <= editor.hist_count; ++back)
+    {
+        size_t len;
+        const char *cmd = editor_history(back, &len);
+        if (history_matches(cmd, len, editor.search, editor.search_len, false))
+            return back;
+    }
+    return 0;
+}
+
+// Up and Down. The line being typed is kept aside while we look at history
+void editor_browse(bool older)
+{
+    if (older ? editor.back == editor.hist_count : editor.back == 0)
+        return;
+
+    if (editor.back == 0)
+    {
+        if (!editor_grow(&editor.saved, &editor.saved_cap, editor.len + 1))
+            return;
+        memcpy(editor.saved, editor.buf, editor.len);
+        editor.saved[editor.len] = '\0';
+    }
+
+    editor.back += older ? 1 : -1;
+    if (editor.back == 0)
+    {
+        size_t n = strlen(editor.saved);
+        editor_set(editor.saved, n, n);
+        return;
+    }
+
+    size_t len;
+    const char *cmd = editor_history(editor.back, &len);
+    editor_set(cmd, len, len);
+}
+
+// Look for the pattern starting `back` commands back, and show the match
+void editor_search(size_t back)
+{
+    // On a miss the last match stays up and the search says it is failing
+    size_t hit = editor.search_len == 0 ? 0 : editor_history_find(back);
+    editor.search_back = hit;
+    if (hit != 0)
+    {
+        size_t len;
+        const char *cmd = editor_history(hit, &len);
+        const char *at = memmem(cmd, len, editor.search, editor.search_len);
+        editor_set(cmd, len, at - cmd);
+    }
+    editor_redraw();
+}
+
+// One key while searching. Returns false once the search is over and the
+// key still needs to be handled as a normal one
+bool editor_search_key(unsigned char c)
+{
+    if (c == 0x12) // Ctrl-R, look further back
+    {
+        if (editor.search_back != 0)
+            editor_search(editor.search_back + 1);
+        return true;
+    }
+
+    if (c == 0x07) // Ctrl-G gives up and puts the line back
+    {
+        size_t n = strlen(editor.saved);
+        editor_set(editor.saved, n, n);
+        editor.searching = false;
+        editor_redraw();
+        return true;
+    }
+
+    if (c == 0x7f || c == '\b')
+    {
+        if (editor.search_len > 0)
+        {
+            editor.search_len--;
+            editor_search(1);
+        }
+        return true;
+    }
+
+    if (c >= 0x20 && c != 0x7f)
+    {
+        if (editor.search_len < EDITOR_SEARCH_MAX)
+            editor.search[editor.search_len++] = c;
+        editor_search(editor.search_back ? editor.search_back : 1);
+        return true;
+    }
+
+    // Anything else takes the match and gets on with it
+    editor.searching = false;
+    editor.back = 0;
+    editor_redraw();
+    return false;
+}
+
+/* Completion */
+
+// Show every match under the line, then the line again
+void editor_list(const struct completions *c)
+{
+    size_t pos = editor.pos;
+    editor.pos = editor.len;
+    editor_refresh();
+    editor.pos = pos;
+    editor_emit("\n", 1);
+
+    if (c->count > EDITOR_LIST_MAX)
+    {
+        char msg[64];
+        editor_emit(msg, snprintf(msg, sizeof(msg), "%zu possibilities\n", c->count));
+    }
+    else
+    {
+        size_t width = editor.cols;
+
+        size_t widest = 0;
+        for (size_t i = 0; i < c->count; ++i)
+        {
+            size_t cols = editor_columns(c->names[i], strlen(c->names[i]));
+            if (cols > widest)
+                widest = cols;
+        }
+
+        // Down the columns, like ls
+        size_t ncols = width / (widest + 2) ? width / (widest + 2) : 1;
+        size_t rows = (c->count + ncols - 1) / ncols;
+        for (size_t r = 0; r < rows; ++r)
+        {
+            for (size_t i = r; i < c->count; i += rows)
+            {
+                size_t len = strlen(c->names[i]);
+                editor_emit(c->names[i], len);
+                if (i + rows < c->count)
+                {
+                    for (size_t pad = editor_columns(c->names[i], len); pad < widest + 2; ++pad)
+                        editor_emit(" ", 1);
+                }
+            }
+            editor_emit("\n", 1);
+        }
+    }
+
+    editor_redraw();
+}
+
+// Tab. One match is filled in, several are filled in as far as they all
+// agree, and another tab right after that lists them
+void editor_complete()
+{
+    size_t start = editor.pos;
+    while (start > 0 && !strchr(WHITESPACE "|&;", editor.buf[start - 1]))
+        start--;
+
+    size_t before = start;
+    while (before > 0 && strchr(WHITESPACE, editor.buf[before - 1]))
+        before--;
+    bool command = before == 0 || strchr("|&;", editor.buf[before - 1]);
+
+    struct completions *c = &editor.completion;
+    size_t len = editor.pos - start;
+    complete_word(c, editor.buf + start, len, command);
+    if (c->count == 0)
+    {
+        editor_emit("\a", 1);
+        return;
+    }
+
+    // Only what comes after the last slash is being completed
+    const char *slash = memrchr(editor.buf + start, '/', len);
+    size_t have = slash ? (size_t)(editor.buf + editor.pos - slash - 1) : len;
+
+    size_t common = strlen(c->names[0]);
+    for (size_t i = 1; i < c->count; ++i)
+    {
+        size_t n = 0;
+        while (n < common && c->names[i][n] == c->names[0][n])
+            n++;
+        common = n;
+    }
+
+    for (size_t i = have; i < common; ++i)
+        editor_insert(c->names[0][i]);
+
+    if (c->count == 1)
+        editor_insert(c->dir ? '/' : ' ');
+    else if (common == have)
+    {
+        if (editor.tabs >= 2)
+            editor_list(c);
+        else
+            editor_emit("\a", 1);
+    }
+}
+
+/* Keys */
+
+enum editor_result
+{
+    EDITOR_MORE,
+    EDITOR_LINE,
+    EDITOR_CANCEL,
+    EDITOR_EOF,
+};
+
+// The last byte of an escape sequence, `arg` is its number if it had one
+void editor_escape(unsigned char c, unsigned arg)
+{
+    if (c == 'A')
+        editor_browse(true);
+    else if (c == 'B')
+        editor_browse(false);
+    else if (c == 'C')
+        editor.pos = editor_next(editor.pos);
+    else if (c == 'D')
+        editor.pos = editor_prev(editor.pos);
+    else if (c == 'H' || (c == '~' && (arg == 1 || arg == 7)))
+        editor.pos = 0;
+    else if (c == 'F' || (c == '~' && (arg == 4 || arg == 8)))
+        editor.pos = editor.len;
+    else if (c == '~' && arg == 3 && editor.pos < editor.len)
+        editor_delete(editor.pos, editor_next(editor.pos));
+}
+
+enum editor_result editor_key(unsigned char c)
+{
+    // Escape sequences can be split across reads, so where we are in one is
+    // kept in the editor
+    if (editor.esc == 1)
+    {
+        editor.esc = c == '[' || c == 'O' ? 2 : 0;
+        editor.esc_arg = 0;
+        return EDITOR_MORE;
+    }
+    if (editor.esc == 2)
+    {
+        if (c >= '0' && c <= '9')
+            editor.esc_arg = editor.esc_arg * 10 + c - '0';
+        else if (c >= 0x40 && c <= 0x7e)
+        {
+            editor.esc = 0;
+            if (editor.searching)
+                editor_search_key(0x1b);
+            editor_escape(c, editor.esc_arg);
+        }
+        return EDITOR_MORE;
+    }
+
+    if (c == 0x1b)
+    {
+        editor.esc = 1;
+        return EDITOR_MORE;
+    }
+
+    if (editor.searching && editor_search_key(c))
+        return EDITOR_MORE;
+
+    editor.tabs = c == '\t' ? editor.tabs + 1 : 0;
+
+    switch (c)
+    {
+    case '\t':
+        editor_complete();
+        break;
+    case '\r':
+    case '\n':
+        return EDITOR_LINE;
+    case 0x03: // Ctrl-C
+        return EDITOR_CANCEL;
+    case 0x04: // Ctrl-D
+        if (editor.len == 0)
+            return EDITOR_EOF;
+        if (editor.pos < editor.len)
+            editor_delete(editor.pos, editor_next(editor.pos));
+        break;
+    case 0x7f:
+    case '\b':
+        if (editor.pos > 0)
+            editor_delete(editor_prev(editor.pos), editor.pos);
+        break;
+    case 0x01: // Ctrl-A
+        editor.pos = 0;
+        break;
+    case 0x05: // Ctrl-E
+        editor.pos = editor.len;
+        break;
+    case 0x02: // Ctrl-B
+        editor.pos = editor_prev(editor.pos);
+        break;
+    case 0x06: // Ctrl-F
+        editor.pos = editor_next(editor.pos);
+        break;
+    case 0x0b: // Ctrl-K
+        editor.len = editor.pos;
+        break;
+    case 0x15: // Ctrl-U
+        editor_delete(0, editor.pos);
+        break;
+    case 0x17: // Ctrl-W, back to the start of the previous word
+    {
+        size_t start = editor.pos;
+        while (start > 0 && strchr(WHITESPACE, editor.buf[start - 1]))
+            start--;
+        while (start > 0 && !strchr(WHITESPACE, editor.buf[start - 1]))
+            start--;
+        editor_delete(start, editor.pos);
+        break;
+    }
+    case 0x0c: // Ctrl-L
+        editor_emit("\x1b[H\x1b[2J", 7);
+        editor_redraw();
+        break;
+    case 0x10: // Ctrl-P
+        editor_browse(true);
+        break;
+    case 0x0e: // Ctrl-N
+        editor_browse(false);
+        break;
+    case 0x12: // Ctrl-R
+    {
+        if (!editor_grow(&editor.saved, &editor.saved_cap, editor.len + 1))
+            break;
+        memcpy(editor.saved, editor.buf, editor.len);
+        editor.saved[editor.len] = '\0';
+        editor.searching = true;
+        editor.back = 0;
+        editor.search_len = 0;
+        editor.search_back = 0;
+        editor_redraw();
+        break;
+    }
+    default:
+        // Control characters we don't know do nothing, anything else
+        // (UTF-8 included) goes into the line
+        if (c >= 0x20)
+            editor_insert(c);
+        break;
+    }
+
+    return EDITOR_MORE;
+}
+
+// Read a line at the terminal. Returns NULL at end of input, otherwise the
+// line, which stays valid until the next call
+char *editor_getline(const char *prompt)
+{
+    struct termios raw;
+
+    // A command may have changed the terminal's settings, so take them from
+    // the terminal every time instead of trusting what we had before
+    if (tcgetattr(STDIN_FILENO, &editor.cooked) == -1)
+    {
+        editor.enabled = false;
+        return reader_getline(&input);
+    }
+    raw = editor.cooked;
+
+    // With job control we ignore the terminal's signals anyway, so ^C comes
+    // to us as a key and throws the line away. Without it ^C and ^Z do what
+    // they did before there was an editor. Output is left alone
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+    if (JOB_CONTROL)
+        raw.c_lflag &= ~ISIG;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    editor.prompt = prompt;
+    editor.prompt_cols = editor_columns(prompt, strlen(prompt));
+    editor.len = editor.pos = editor.off = 0;
+    editor.shown_len = editor.scr = 0;
+    editor_size();
+    editor.esc = 0;
+    editor.back = 0;
+    editor.searching = false;
+    if (!editor_grow(&editor.buf, &editor.cap, 1) ||
+        !editor_grow(&editor.shown, &editor.shown_cap, 1))
+    {
+        perror("msh");
+        exit(EXIT_FAILURE);
+    }
+
+    // What there is to browse is fixed for the length of the line
+    if (histlog.fd != -1)
+    {
+        histlog_index();
+        editor.hist_count = histlog.count;
+    }
+    else
+    {
+        editor.hist_count = 0;
+        for (int i = 0; i < HISTORY_SIZE && history[i].cmd != NULL; ++i)
+            editor.hist_count++;
+    }
+
+    editor_emit(prompt, strlen(prompt));
+    editor_flush();
+
+    // A resize only gets in while we wait for keys, so it can't cut short
+    // a write somewhere else
+    sigset_t winch, old;
+    sigemptyset(&winch);
+    sigaddset(&winch, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &winch, &old);
+
+    enum editor_result result = EDITOR_MORE;
+    while (result == EDITOR_MORE)
+    {
+        if (editor.in_start == editor.in_end)
+        {
+            struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+            if (ppoll(&pfd, 1, NULL, &old) == -1)
+            {
+                if (errno != EINTR)
+                {
+                    result = EDITOR_EOF;
+                    break;
+                }
+                if (editor_resized)
+                {
+                    editor_size();
+                    editor_redraw();
+                    editor_flush();
+                }
+                continue;
+            }
+
+            ssize_t n = read(STDIN_FILENO, editor.in, sizeof(editor.in));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                result = EDITOR_EOF;
+                break;
+            }
+            editor.in_start = 0;
+            editor.in_end = n;
+        }
+
+        // Take the whole burst, then draw once
+        while (result == EDITOR_MORE && editor.in_start < editor.in_end)
+            result = editor_key(editor.in[editor.in_start++]);
+
+        if (editor.searching && result == EDITOR_LINE)
+        {
+            editor.searching = false;
+            editor_redraw();
+        }
+
+        // A line that had to scroll is written out whole once it is done,
+        // and wraps like any other output
+        if (result == EDITOR_LINE || result == EDITOR_CANCEL)
+        {
+            editor.pos = editor.len;
+            size_t shown = editor_scroll();
+            if (editor.off > 0 || shown < editor.len)
+            {
+                editor.cols = SIZE_MAX;
+                editor_redraw();
+            }
+        }
+        editor_refresh();
+        if (result == EDITOR_CANCEL)
+            editor_emit("^C", 2);
+        if (result == EDITOR_LINE || result == EDITOR_CANCEL)
+            editor_emit("\n", 1);
+        editor_flush();
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    tcsetattr(STDIN_FILENO, TCSANOW, &editor.cooked);
+
+    if (result == EDITOR_EOF)
+        return NULL;
+
+    // Whatever was typed stays on the screen, but nothing gets run
+    if (result == EDITOR_CANCEL)
+    {
+        editor.searching = false;
+        editor.len = 0;
+    }
+    editor.buf[editor.len] = '\0';
+    return editor.buf;
+}
+
+/*
+ * Job table
+ *
+ * Every pipeline we start becomes a job, foreground or not. Children are
+ * reaped with wait4(-1), so whoever is doing the waiting picks up every
+ * child that finishes, including background ones, and the SIGCHLD handler
+ * only has to tell the main loop that something is worth looking at.
+ */
+struct job_proc
+{
+    pid_t pid;
+    int status; // Wait status once it is done
+    bool done;
+};
+
+// Monotonic clock in microseconds, for timing commands
+long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long timeval_us(struct timeval tv)
+{
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+struct job
+{
+    int id;             // What the user calls it, 0 when the slot is free
+    unsigned long seq;  // Start order, the newest job is the default for fg/bg
+    bool background;
+    bool stopped;
+    bool notified;      // Done and already reported, just waiting to be freed
+    pid_t pgid;         // Its process group with job control, 0 if none yet
+    struct termios tmodes; // The terminal as it left it when it got stopped
+    bool has_tmodes;
+    struct job_proc *procs;
+    size_t nprocs;
+    size_t nalive;
+    char *cmd;
+
+    // procs by pid, so a parallel run with thousands of them doesn't get
+    // scanned for every child that exits. Open addressing over a power of
+    // two, the entries are indices into procs plus one and 0 is free
+    size_t *pid_slots;
+    size_t pid_mask;
+
+    // The history slot this job reports to once it is done
+    struct command *entry;
+    unsigned long entry_seq;
+    bool deferred; // Outlived its command line, so it logs its own record
+
+    // Totals over every process, from wait4
+    long long start_us;
+    long long end_us;
+    long long user_us;
+    long long sys_us;
+    long maxrss_kb;
+};
+
+struct job *jobs = NULL;
+size_t jobs_cap = 0;
+unsigned long job_seq = 0;
+
+volatile sig_atomic_t children_changed = 0;
+
+/*
+ * Job control
+ *
+ * An interactive shell puts every job in a process group of its own and
+ * hands the terminal to the one in the foreground, so the terminal's ^C and
+ * ^Z go to the job and never to us. The shell ignores them itself. Children
+ * get the default signals back before they exec, since an ignored signal
+ * would otherwise stay ignored across the exec.
+ */
+bool job_control = false;
+int shell_terminal = STDIN_FILENO;
+pid_t shell_pgid = 0;
+pid_t original_pgid = 0;         // Who had the terminal before us
+struct termios shell_tmodes;
+
+// The signals we ignore and our children must not. A child that stays in
+// our own process group, like a command substitution, only gets SIGINT and
+// SIGQUIT back: ^Z would stop it while we sit waiting for it, with nobody
+// left to ever continue it
+const int job_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+sigset_t job_sigset, own_group_sigset;
+
+// Put back the defaults for the ones in `set`
+void default_job_signals(const sigset_t *set)
+{
+    for (size_t i = 0; i < sizeof(job_signals) / sizeof(*job_signals); ++i)
+    {
+        if (sigismember(set, job_signals[i]))
+            signal(job_signals[i], SIG_DFL);
+    }
+}
+
+void on_sigchld(int sig)
+{
+    (void)sig;
+    children_changed = 1;
+}
+
+void init_job_control()
+{
+    // Started in the background, wait until we are brought to the front
+    // before we take the terminal from anyone
+    while (tcgetpgrp(shell_terminal) != (original_pgid = getpgrp()))
+        kill(-original_pgid, SIGTTIN);
+
+    sigemptyset(&job_sigset);
+    for (size_t i = 0; i < sizeof(job_signals) / sizeof(*job_signals); ++i)
+    {
+        signal(job_signals[i], SIG_IGN);
+        sigaddset(&job_sigset, job_signals[i]);
+    }
+    sigemptyset(&own_group_sigset);
+    sigaddset(&own_group_sigset, SIGINT);
+    sigaddset(&own_group_sigset, SIGQUIT);
+
+    // A session leader already is the leader of its group, so EPERM is fine
+    shell_pgid = getpid();
+    if (setpgid(shell_pgid, shell_pgid) == -1 && errno != EPERM)
+    {
+        perror("msh: setpgid");
+        return;
+    }
+    shell_pgid = getpgrp();
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcgetattr(shell_terminal, &shell_tmodes);
+    job_control = true;
+}
+
+// Give the terminal back to whoever had it before us
+void end_job_control()
+{
+    if (JOB_CONTROL && original_pgid != shell_pgid)
+        tcsetpgrp(shell_terminal, original_pgid);
+}
+
+void init_jobs()
+{
+    struct sigaction sa = {0};
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (MSH_FEATURE_JOB_CONTROL && interactive && isatty(shell_terminal))
+        init_job_control();
+}
+
+// Returns a fresh job with room for `nprocs` processes, reporting to the
+// history entry `entry`. Ids are the slot numbers, so they get reused once a
+// job is gone like in other shells
+struct job *new_job(struct command *entry, size_t nprocs)
+{
+    const char *cmd = entry ? entry->cmd : "";
+    size_t cmd_len = strlen(cmd);
+
+    // A job that is only one part of its line is named after that part
+    if (list_count > 1 && list_parsed < list_count)
+    {
+        cmd = list_line + list[list_parsed].start;
+        cmd_len = list[list_parsed].len;
+        while (cmd_len > 0 && strchr(WHITESPACE, *cmd))
+            cmd++, cmd_len--;
+    }
+
+    size_t slot = 0;
+    while (slot < jobs_cap && jobs[slot].id != 0)
+        slot++;
+
+    if (slot == jobs_cap)
+    {
+        size_t cap = jobs_cap ? jobs_cap * 2 : 8;
+        struct job *grown = realloc(jobs, cap * sizeof(*jobs));
+        if (grown == NULL)
+            return NULL;
+        memset(grown + jobs_cap, 0, (cap - jobs_cap) * sizeof(*jobs));
+        jobs = grown;
+        jobs_cap = cap;
+    }
+
+    // At most half full
+    size_t slots = 2;
+    while (slots < 2 * nprocs)
+        slots *= 2;
+
+    struct job *job = &jobs[slot];
+    job->procs = calloc(nprocs ? nprocs : 1, sizeof(*job->procs));
+    job->pid_slots = calloc(slots, sizeof(*job->pid_slots));
+    job->pid_mask = slots - 1;
+    job->cmd = strndup(cmd, cmd_len);
+    if (job->procs == NULL || job->pid_slots == NULL || job->cmd == NULL)
+    {
+        free(job->procs);
+        free(job->pid_slots);
+        free(job->cmd);
+        return NULL;
+    }
+
+    // The job is named after its command line, minus the `&` that sent it to
+    // the background. print_job puts that back where it belongs
+    size_t len = strlen(job->cmd);
+    while (len > 0 && strchr(WHITESPACE, job->cmd[len - 1]))
+        len--;
+    if (len > 0 && job->cmd[len - 1] == '&' && (len == 1 || job->cmd[len - 2] != '&'))
+        len--;
+    while (len > 0 && strchr(WHITESPACE, job->cmd[len - 1]))
+        len--;
+    job->cmd[len] = '\0';
+
+    job->id = slot + 1;
+    job->seq = ++job_seq;
+    job->background = false;
+    job->stopped = false;
+    job->notified = false;
+    job->pgid = 0;
+    job->has_tmodes = false;
+    job->nprocs = 0;
+    job->nalive = 0;
+    job->entry = entry;
+    job->entry_seq = entry ? entry->seq : 0;
+    job->deferred = false;
+    job->start_us = entry ? entry->start_us : now_us();
+    job->end_us = 0;
+    job->user_us = job->sys_us = 0;
+    job->maxrss_kb = 0;
+    return job;
+}
+
+size_t job_pid_hash(const struct job *job, pid_t pid)
+{
+    return ((uint32_t)pid * 2654435761u) & job->pid_mask;
+}
+
+void job_add_proc(struct job *job, pid_t pid)
+{
+    size_t h = job_pid_hash(job, pid);
+    while (job->pid_slots[h] != 0)
+        h = (h + 1) & job->pid_mask;
+    job->pid_slots[h] = job->nprocs + 1;
+
+    job->procs[job->nprocs].pid = pid;
+    job->procs[job->nprocs].done = false;
+    job->nprocs++;
+    job->nalive++;
+}
+
+// The wait status of a job is the one of its last stage, like in other shells
+int job_status(const struct job *job)
+{
+    return job->nprocs ? job->procs[job->nprocs - 1].status : -1;
+}
+
+// Hand a finished job's numbers to its history entry, unless the ring has
+// moved on and the slot belongs to some other command by now
+void job_to_history(const struct job *job)
+{
+    if (job->nprocs == 0 || job->nalive > 0)
+        return;
+
+    // If the slot was reused the record can still go to the log
+    struct command scratch = {0};
+    struct command *entry = job->entry;
+    if (entry == NULL || entry->seq != job->entry_seq)
+    {
+        if (!job->deferred)
+            return;
+        entry = &scratch;
+        entry->cmd = job->cmd;
+        entry->when = time(NULL) - (job->end_us - job->start_us) / 1000000;
+    }
+
+    // A line can run several jobs, its times are what they all took
+    entry->status = job_status(job);
+    entry->wall_us = job->end_us - job->start_us;
+    entry->user_us += job->user_us;
+    entry->sys_us += job->sys_us;
+    if (job->maxrss_kb > entry->maxrss_kb)
+        entry->maxrss_kb = job->maxrss_kb;
+    entry->pending = false;
+
+    // Jobs that finish with their command line get logged by it, the rest
+    // have to do it themselves
+    if (job->deferred)
+    {
+        pid_t *pids = NULL;
+        if (entry == &scratch && (pids = malloc(job->nprocs * sizeof(*pids))) != NULL)
+        {
+            for (size_t i = 0; i < job->nprocs; ++i)
+                pids[i] = job->procs[i].pid;
+            entry->pids = pids;
+            entry->npids = job->nprocs;
+        }
+
+        histlog_append(entry);
+        free(pids);
+    }
+}
+
+// The job is going to outlive the command line that started it
+void defer_job(struct job *job)
+{
+    job->deferred = true;
+    if (job->entry != NULL && job->entry->seq == job->entry_seq)
+        job->entry->pending = true;
+}
+
+void free_job(struct job *job)
+{
+    job_to_history(job);
+    free(job->procs);
+    free(job->pid_slots);
+    free(job->cmd);
+    memset(job, 0, sizeof(*job));
+}
+
+// The process in `job` that is still running as `pid`. A long parallel run
+// can see a pid come around again, the one that is done doesn't count
+struct job_proc *job_find_proc(const struct job *job, pid_t pid)
+{
+    for (size_t h = job_pid_hash(job, pid); job->pid_slots[h] != 0; h = (h + 1) & job->pid_mask)
+    {
+        struct job_proc *proc = &job->procs[job->pid_slots[h] - 1];
+        if (proc->pid == pid && !proc->done)
+            return proc;
+    }
+    return NULL;
+}
+
+// File the news about one child with the job it belongs to
+void record_child(pid_t pid, int status, const struct rusage *ru)
+{
+    for (size_t i = 0; i < jobs_cap; ++i)
+    {
+        struct job *job = &jobs[i];
+        struct job_proc *proc;
+        if (job->id == 0 || (proc = job_find_proc(job, pid)) == NULL)
+            continue;
+
+        if (WIFSTOPPED(status))
+            job->stopped = true;
+        else if (WIFCONTINUED(status))
+            job->stopped = false;
+        else
+        {
+            proc->status = status;
+            proc->done = true;
+            job->nalive--;
+
+            job->user_us += timeval_us(ru->ru_utime);
+            job->sys_us += timeval_us(ru->ru_stime);
+            if (ru->ru_maxrss > job->maxrss_kb)
+                job->maxrss_kb = ru->ru_maxrss;
+            if (job->nalive == 0)
+                job->end_us = now_us();
+        }
+        return;
+    }
+}
+
+// Pick up every child that has changed state without blocking
+void reap_children()
+{
+    children_changed = 0;
+
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        record_child(pid, status, &ru);
+}
+
+// Block until some child changes state and file it with its job. Returns
+// false if there are no children left to wait for
+bool wait_one_child()
+{
+    int status;
+    pid_t pid;
+    struct rusage ru;
+
+    while ((pid = wait4(-1, &status, WUNTRACED, &ru)) == -1)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+
+    record_child(pid, status, &ru);
+    return true;
+}
+
+// Block until every process in the job has exited or the job gets stopped.
+// Anything else that exits meanwhile is filed with its own job
+void wait_for_job(struct job *job)
+{
+    while (job->nalive > 0 && !job->stopped)
+    {
+        if (!wait_one_child())
+        {
+            // No children left at all, so nothing in the job is alive either
+            for (size_t i = 0; i < job->nprocs; ++i)
+                job->procs[i].done = true;
+            job->nalive = 0;
+        }
+    }
+}
+
+const char *job_state_name(const struct job *job)
+{
+    if (job->nalive == 0)
+        return "Done";
+    return job->stopped ? "Stopped" : "Running";
+}
+
+// The newest job, which is what fg/bg/wait use without an argument
+struct job *current_job()
+{
+    struct job *best = NULL;
+    for (size_t i = 0; i < jobs_cap; ++i)
+    {
+        if (jobs[i].id != 0 && !jobs[i].notified && (best == NULL || jobs[i].seq > best->seq))
+            best = &jobs[i];
+    }
+    return best;
+}
+
+void print_job(const struct job *job, bool pids)
+{
+    printf("[%d]%c  %-8s", job->id, job == current_job() ? '+' : ' ', job_state_name(job));
+    if (pids)
+    {
+        for (size_t i = 0; i < job->nprocs; ++i)
+            printf(" %d", job->procs[i].pid);
+    }
+    printf("  %s%s\n", job->cmd, job->nalive > 0 && !job->stopped ? " &" : "");
+}
+
+// Report background jobs that finished since the last prompt and forget them
+void notify_jobs()
+{
+    if (children_changed)
+        reap_children();
+
+    for (size_t i = 0; i < jobs_cap; ++i)
+    {
+        struct job *job = &jobs[i];
+        if (job->id == 0 || !job->background || job->nalive > 0)
+            continue;
+
+        if (interactive)
+            print_job(job, false);
+        free_job(job);
+    }
+}
+
+// Understands `%n`, `n`, `%%` and `%+`. With no spec at all it means the
+// current job
+struct job *find_job(const char *spec)
+{
+    if (spec == NULL || !strcmp(spec, "%%") || !strcmp(spec, "%+"))
+        return current_job();
+
+    if (*spec == '%')
+        spec++;
+
+    char *endp;
+    long id = strtol(spec, &endp, 10);
+    if (*spec == '\0' || *endp != '\0' || id <= 0 || (size_t)id > jobs_cap)
+        return NULL;
+
+    struct job *job = &jobs[id - 1];
+    return job->id != 0 ? job : NULL;
+}
+
+// Send `sig` to every process in the job. With job control that is its
+// whole group, which also has whatever a forked builtin like parallel
+// started and we never heard of
+void signal_job(struct job *job, int sig)
+{
+    if (JOB_CONTROL && job->pgid != 0)
+    {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (size_t i = 0; i < job->nprocs; ++i)
+    {
+        if (!job->procs[i].done)
+            kill(job->procs[i].pid, sig);
+    }
+}
+
+// Wake up every process in a stopped job
+void continue_job(struct job *job)
+{
+    signal_job(job, SIGCONT);
+    job->stopped = false;
+}
+
+// Stopped jobs would sit around forever once we are gone, so hang them up
+// and wake them so they get the signal, like other shells do on exit
+void hangup_stopped_jobs()
+{
+    for (size_t i = 0; i < jobs_cap; ++i)
+    {
+        if (jobs[i].id == 0 || !jobs[i].stopped)
+            continue;
+
+        signal_job(&jobs[i], SIGHUP);
+        continue_job(&jobs[i]);
+    }
+}
+
+// Take the terminal back once a foreground job is done with it. A job that
+// got stopped or killed may have left it in any state, so it goes back to
+// ours. One that exited on its own (say stty) changed it on purpose
+void reclaim_terminal(struct job *job)
+{
+    if (!JOB_CONTROL)
+        return;
+
+    tcsetpgrp(shell_terminal, shell_pgid);
+
+    int status = job_status(job);
+    if (job->stopped)
+        job->has_tmodes = tcgetattr(shell_terminal, &job->tmodes) == 0;
+    if (job->stopped || (status != -1 && WIFSIGNALED(status)))
+        tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    else
+        tcgetattr(shell_terminal, &shell_tmodes);
+}
+
+// Once a foreground job is no longer running, either free it and return its
+// status, or keep it around as a stopped background job and return -1
+int finish_foreground(struct job *job)
+{
+    reclaim_terminal(job);
+
+    if (job->stopped)
+    {
+        job->background = true;
+        defer_job(job);
+        putchar('\n');
+        print_job(job, false);
+        return -1;
+    }
+
+    // The ^C was echoed where the job left the cursor
+    int status = job_status(job);
+    if (JOB_CONTROL && status != -1 && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+        putchar('\n');
+    free_job(job);
+    return status;
+}
+
+// Bring a background job to the front, waking it up if it was stopped
+int foreground_job(struct job *job)
+{
+    job->background = false;
+    if (JOB_CONTROL && job->pgid != 0)
+    {
+        tcsetpgrp(shell_terminal, job->pgid);
+        if (job->has_tmodes)
+            tcsetattr(shell_terminal, TCSADRAIN, &job->tmodes);
+    }
+    if (job->stopped)
+        continue_job(job);
+
+    wait_for_job(job);
+    return finish_foreground(job);
+}
+
+/*
+ * Spawn engines
+ *
+ * fork() has to copy the shell's page tables, which gets slower the bigger
+ * the shell's heap gets. posix_spawn (a CLONE_VM|CLONE_VFORK clone in glibc)
+ * doesn't copy anything, so it is what we use for plain external commands.
+ * fork is kept around for anything that has to run our own code in the child
+ * before exec, and can be forced everywhere by building with -DMSH_USE_FORK
+ * (`make msh-fork`) to compare the two.
+ */
+#ifdef MSH_USE_FORK
+#define USE_POSIX_SPAWN 0
+#else
+#define USE_POSIX_SPAWN 1
+#endif
+
+extern char **environ;
+
+// What a stage that could not be started counts as having exited with
+int start_failure = 127;
+
+// With job control, the process group the next stage goes in: 0 starts a
+// new one, anything else joins that one, and -1 leaves it in ours. When a
+// stage starts a foreground group it takes the terminal along with it, so
+// it can't read the terminal before it is allowed to
+pid_t stage_pgid = -1;
+bool stage_foreground = false;
+
+// posix_spawn can hand the terminal over in the child since glibc 2.35
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define HAVE_SPAWN_TCSETPGRP 1
+#else
+#define HAVE_SPAWN_TCSETPGRP 0
+#endif
+
+/*
+ * Resource limits
+ *
+ *     limit [-m size] [-t seconds] [-n files] [-c cgroup] command [args...]
+ *
+ * Runs one pipeline stage with setrlimit limits on its address space (-m,
+ * with a K, M, G or T suffix), CPU time (-t) and open files (-n), and with -c
+ * in a cgroup v2 leaf (made if it isn't there yet, relative paths are under
+ * /sys/fs/cgroup). Limits have to be set between the fork and the exec, so a
+ * limited stage always forks, even with the posix_spawn engine. The cgroup
+ * is joined with clone3(CLONE_INTO_CGROUP) so the command never runs outside
+ * it, or by the child itself on kernels without that. What the command got
+ * up to shows in history -t like for any other: a CPU time limit kills it
+ * with SIGXCPU, the cgroup's OOM killer with SIGKILL.
+ */
+struct limit_option
+{
+    char opt;
+    int resource;
+    bool sized;     // Takes a K, M, G or T suffix
+};
+
+const struct limit_option limit_options[] = {
+    {'m', RLIMIT_AS, true},
+    {'t', RLIMIT_CPU, false},
+    {'n', RLIMIT_NOFILE, false},
+};
+
+#define LIMIT_OPTIONS (sizeof(limit_options) / sizeof(*limit_options))
+
+// The limits for the stage about to be started, passed along like the
+// process group above
+struct stage_limits
+{
+    bool active;
+    bool set[LIMIT_OPTIONS];
+    rlim_t value[LIMIT_OPTIONS];
+    int cgroup;      // -1 without -c
+    bool joined;     // In the child, the clone already put us in it
+} stage_limits = {.cgroup = -1};
+
+// A number, with `sized` optionally with a K, M, G or T after it
+bool parse_limit(const char *s, bool sized, rlim_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || *s == '-')
+        return false;
+
+    int shift = 0;
+    const char *units = "KMGT";
+    const char *u = sized && *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (u != NULL)
+    {
+        shift = 10 * (u - units + 1);
+        end++;
+    }
+    if (*end != '\0' || (shift && n > (ULLONG_MAX >> shift)))
+        return false;
+
+    *size = (rlim_t)n << shift;
+    return true;
+}
+
+bool open_limit_cgroup(const char *name)
+{
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/sys/fs/cgroup/", name);
+    if (n < 0 || (size_t)n >= sizeof(path))
+    {
+        fprintf(stderr, "limit: %s: path too long\n", name);
+        return false;
+    }
+
+    stage_limits.cgroup = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (stage_limits.cgroup == -1 && errno == ENOENT && mkdir(path, 0755) == 0)
+        stage_limits.cgroup = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (stage_limits.cgroup == -1)
+    {
+        fprintf(stderr, "limit: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void clear_limits()
+{
+    if (stage_limits.cgroup != -1)
+        close(stage_limits.cgroup);
+    stage_limits = (struct stage_limits){.cgroup = -1};
+}
+
+// Fill in stage_limits from a `limit ...` stage and return the command it
+// limits, or NULL after complaining about it
+char **parse_limits(char **argv)
+{
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i += 2)
+    {
+        if (!strcmp(argv[i], "--"))
+        {
+            i++;
+            break;
+        }
+
+        const char *arg = argv[i + 1];
+        if (arg == NULL || argv[i][2] != '\0')
+            break;
+
+        if (argv[i][1] == 'c')
+        {
+            if (stage_limits.cgroup != -1)
+                close(stage_limits.cgroup);
+            if (!open_limit_cgroup(arg))
+            {
+                clear_limits();
+                return NULL;
+            }
+            stage_limits.active = true;
+            continue;
+        }
+
+        size_t o = 0;
+        while (o < LIMIT_OPTIONS && limit_options[o].opt != argv[i][1])
+            o++;
+        if (o == LIMIT_OPTIONS)
+            break;
+
+        rlim_t value;
+        if (!parse_limit(arg, limit_options[o].sized, &value))
+        {
+            fprintf(stderr, "limit: %s: bad value for -%c\n", arg, argv[i][1]);
+            clear_limits();
+            return NULL;
+        }
+        stage_limits.set[o] = true;
+        stage_limits.value[o] = value;
+        stage_limits.active = true;
+    }
+
+    if (argv[i] == NULL || argv[i][0] == '-')
+    {
+        fputs("usage: limit [-m size] [-t seconds] [-n files] [-c cgroup] command [args...]\n", stderr);
+        clear_limits();
+        return NULL;
+    }
+    return argv + i;
+}
+
+// fork(), or with a cgroup a clone3() that starts the child in it
+pid_t stage_fork()
+{
+    if (stage_limits.cgroup != -1)
+    {
+        struct clone_args args = {
+            .flags = CLONE_INTO_CGROUP,
+            .exit_signal = SIGCHLD,
+            .cgroup = stage_limits.cgroup,
+        };
+        pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid == 0)
+            stage_limits.joined = true;
+        if (pid != -1)
+            return pid;
+
+        // Too old a kernel, or no access. The child tries the slow way and
+        // says why if it can't
+    }
+    return fork();
+}
+
+// In the child, before it execs or runs the builtin
+void apply_limits()
+{
+    if (!stage_limits.active)
+        return;
+
+    if (stage_limits.cgroup != -1 && !stage_limits.joined)
+    {
+        int fd = openat(stage_limits.cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd == -1 || write(fd, "0\n", 2) != 2)
+        {
+            perror("limit: cgroup");
+            _exit(126);
+        }
+        close(fd);
+    }
+
+    for (size_t i = 0; i < LIMIT_OPTIONS; ++i)
+    {
+        if (!stage_limits.set[i])
+            continue;
+
+        // A CPU time limit is a SIGXCPU at the soft limit, leave a second
+        // before the SIGKILL at the hard one so that is what it dies of
+        struct rlimit rl = {stage_limits.value[i], stage_limits.value[i]};
+        if (limit_options[i].resource == RLIMIT_CPU && rl.rlim_max != RLIM_INFINITY)
+            rl.rlim_max++;
+        if (setrlimit(limit_options[i].resource, &rl) == -1)
+        {
+            perror("limit");
+            _exit(126);
+        }
+    }
+}
+
+/*
+ * Redirections are applied after the pipeline's pipes, in the order they
+ * were written, so `2>&1 |` sends stderr down the pipe too. A forked child
+ * opens and dup2s the files itself. posix_spawn can't tell a file it
+ * couldn't open apart from a command it couldn't find, so for it the shell
+ * opens the files up front and the child only gets dup2 file actions.
+ */
+
+// Open every file for posix_spawn. The descriptors are kept above any the
+// redirections write to, so no dup2 can clobber one before it is used
+bool redirect_open(struct redirect *r, size_t n)
+{
+    int low = 10;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (r[i].fd >= low)
+            low = r[i].fd + 1;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (r[i].flags == -1)
+            continue;
+
+        int fd = open(r[i].path, r[i].flags | O_CLOEXEC, 0666);
+        if (fd != -1)
+        {
+            r[i].opened = fcntl(fd, F_DUPFD_CLOEXEC, low);
+            close(fd);
+        }
+        if (fd == -1 || r[i].opened == -1)
+        {
+            fprintf(stderr, "msh: %s: %s\n", r[i].path, strerror(errno));
+            while (i-- > 0)
+            {
+                if (r[i].opened != -1)
+                    close(r[i].opened);
+                r[i].opened = -1;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+void redirect_close(struct redirect *r, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (r[i].opened != -1)
+            close(r[i].opened);
+        r[i].opened = -1;
+    }
+}
+
+// Apply the redirections to this process. With `save` whatever they replace
+// is kept aside first so redirect_restore can put it back, which is how a
+// builtin running in the shell gets redirected
+bool redirect_apply(struct redirect *r, size_t n, bool save)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (save)
+            r[i].saved = fcntl(r[i].fd, F_DUPFD_CLOEXEC, 10);
+
+        if (r[i].flags != -1)
+        {
+            int fd = open(r[i].path, r[i].flags | O_CLOEXEC, 0666);
+            if (fd == -1)
+            {
+                fprintf(stderr, "msh: %s: %s\n", r[i].path, strerror(errno));
+                return false;
+            }
+            if (fd != r[i].fd)
+            {
+                dup2(fd, r[i].fd);
+                close(fd);
+            }
+            else
+            {
+                fcntl(fd, F_SETFD, 0);
+            }
+        }
+        else if (r[i].from == -1)
+        {
+            close(r[i].fd);
+        }
+        else if (dup2(r[i].from, r[i].fd) == -1)
+        {
+            fprintf(stderr, "msh: %d: %s\n", r[i].from, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Undo redirect_apply, last one first since later ones can stack on earlier
+void redirect_restore(struct redirect *r, size_t n)
+{
+    for (size_t i = n; i-- > 0;)
+    {
+        if (r[i].saved == -2)
+            continue;
+
+        if (r[i].saved == -1)
+            close(r[i].fd);
+        else
+        {
+            dup2(r[i].saved, r[i].fd);
+            close(r[i].saved);
+        }
+        r[i].saved = -2;
+    }
+}
+
+// Both engines return the child's pid, or -1 with errno set if the command
+// could not be started. `in` and `out` become the child's stdin and stdout
+// unless they are -1, then the stage's redirections are applied on top
+pid_t spawn_exec(const char *path, char **argv, int in, int out, struct redirect *r, size_t n)
+{
+    pid_t pid;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *actionsp = NULL;
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *attrp = NULL;
+    bool take_terminal = HAVE_SPAWN_TCSETPGRP && stage_foreground && stage_pgid == 0;
+
+    if (JOB_CONTROL)
+    {
+        attrp = &attr;
+        posix_spawnattr_init(attrp);
+        posix_spawnattr_setsigdefault(attrp, stage_pgid == -1 ? &own_group_sigset : &job_sigset);
+        short flags = POSIX_SPAWN_SETSIGDEF;
+        if (stage_pgid != -1)
+        {
+            posix_spawnattr_setpgroup(attrp, stage_pgid);
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        posix_spawnattr_setflags(attrp, flags);
+    }
+
+    // Plain commands that don't take part in a pipeline don't need any file
+    // actions
+    if (in != -1 || out != -1 || n > 0 || take_terminal)
+    {
+        actionsp = &actions;
+        posix_spawn_file_actions_init(actionsp);
+#if HAVE_SPAWN_TCSETPGRP
+        // Before the dup2s, while the shell's terminal is still where it was
+        if (take_terminal)
+            posix_spawn_file_actions_addtcsetpgrp_np(actionsp, shell_terminal);
+#endif
+        if (in != -1)
+            posix_spawn_file_actions_adddup2(actionsp, in, STDIN_FILENO);
+        if (out != -1)
+            posix_spawn_file_actions_adddup2(actionsp, out, STDOUT_FILENO);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (r[i].flags != -1)
+                posix_spawn_file_actions_adddup2(actionsp, r[i].opened, r[i].fd);
+            else if (r[i].from == -1)
+                posix_spawn_file_actions_addclose(actionsp, r[i].fd);
+            else
+                posix_spawn_file_actions_adddup2(actionsp, r[i].from, r[i].fd);
+        }
+    }
+
+    int err = posix_spawn(&pid, path, actionsp, attrp, argv, env_envp());
+
+    if (actionsp != NULL)
+        posix_spawn_file_actions_destroy(actionsp);
+    if (attrp != NULL)
+        posix_spawnattr_destroy(attrp);
+
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Put a forked child in its job's process group, from both sides of the
+// fork so neither has to wait for the other, and give the child our default
+// signals back. The terminal is taken while SIGTTOU is still ignored
+void join_job(pid_t pid)
+{
+    if (!JOB_CONTROL)
+        return;
+
+    if (stage_pgid != -1)
+        setpgid(pid, stage_pgid);
+    if (pid != 0)
+        return;
+
+    if (stage_foreground && stage_pgid == 0)
+        tcsetpgrp(shell_terminal, getpgrp());
+    default_job_signals(stage_pgid == -1 ? &own_group_sigset : &job_sigset);
+}
+
+// Point the child's stdin and stdout at the pipeline's pipes. Only used
+// after a fork, so there is nobody to report an error to but ourselves
+void child_redirect(int in, int out)
+{
+    if (in != -1)
+    {
+        dup2(in, STDIN_FILENO);
+        close(in);
+    }
+    if (out != -1)
+    {
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+}
+
+pid_t fork_exec(const char *path, char **argv, int in, int out, struct redirect *r, size_t n)
+{
+    char **envp = env_envp();
+    pid_t pid = stage_fork();
+
+    if (pid == -1)
+    {
+        // We can't really do anything but exit
+        perror("fork: fatal error");
+        exit(EXIT_FAILURE);
+    }
+    join_job(pid);
+    if (pid == 0)
+    {
+        apply_limits();
+        child_redirect(in, out);
+        if (!redirect_apply(r, n, false))
+            _exit(1);
+        execve(path, argv, envp);
+
+        // The cached path went away under us. Give PATH one more look before
+        // giving up, the parent will notice the 127 and fix its table
+        if (errno == ENOENT && path != argv[0])
+        {
+            char *again = search_path(argv[0]);
+            if (again != NULL)
+                execve(again, argv, envp);
+            else
+                errno = ENOENT;
+        }
+
+        /* Execution will get here only if failed */
+
+        // If command not found, print that, else print the specific error
+        bool missing = errno == ENOENT;
+        if (missing)
+            fprintf(stderr, "%s: Command not found.\n", argv[0]);
+        else
+            perror(argv[0]);
+
+        // If you don't exit you will basically have two shells now lol.
+        // _exit so we don't flush a copy of the parent's stdio buffers. 126
+        // means it's there but can't be run, like sh says
+        _exit(missing ? 127 : 126);
+    }
+
+    return pid;
+}
+
+// Builtins live further down with run_command_string
+bool is_builtin(const char *name);
+int run_builtin(char **argv);
+
+// A builtin that is part of a pipeline has to run in its own process so it
+// can write into the pipe while the other stages read from it
+pid_t fork_builtin(char **argv, int in, int out, struct redirect *r, size_t n)
+{
+    pid_t pid = stage_fork();
+
+    if (pid == -1)
+    {
+        perror("fork: fatal error");
+        exit(EXIT_FAILURE);
+    }
+    join_job(pid);
+    if (pid == 0)
+    {
+        // Whatever the shell buffered from its input is not ours to read.
+        // Anything the builtin starts belongs in this job's group
+        input.fd = -1;
+        input.start = input.end = 0;
+        input.eof = true;
+        job_control = false;
+
+        apply_limits();
+        child_redirect(in, out);
+        if (!redirect_apply(r, n, false))
+            _exit(1);
+        int status = run_builtin(argv);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    return pid;
+}
+
+pid_t start_command(char **argv, int in, int out, struct redirect *r, size_t n)
+{
+    // The fork engine, and anything limited, opens the files in the child
+    bool forking = !USE_POSIX_SPAWN || stage_limits.active;
+    if (is_builtin(argv[0]))
+    {
+        long long t = TRACE_BEGIN();
+        pid_t pid = fork_builtin(argv, in, out, r, n);
+        TRACE_END_ARG("fork", t, pid, argv[0]);
+        return pid;
+    }
+
+    // Files are opened before the command is looked for, like in any other
+    // shell, so `nosuchcommand >out` still leaves an empty out behind
+    if (!forking && !redirect_open(r, n))
+    {
+        start_failure = 1;
+        return -1;
+    }
+
+    long long t = TRACE_BEGIN();
+    const char *path = hash_lookup(argv[0]);
+    TRACE_END("lookup", t);
+
+    if (path == NULL)
+    {
+        // A forked child would have opened them itself
+        if (forking && !redirect_open(r, n))
+        {
+            start_failure = 1;
+            return -1;
+        }
+        fprintf(stderr, "%s: Command not found.\n", argv[0]);
+        redirect_close(r, n);
+        start_failure = 127;
+        return -1;
+    }
+
+    // A posix_spawn only returns once the child has exec'd, so its time
+    // includes the exec. A fork returns before the child gets anywhere
+    t = TRACE_BEGIN();
+    if (forking)
+    {
+        pid_t pid = fork_exec(path, argv, in, out, r, n);
+        TRACE_END_ARG("fork", t, pid, argv[0]);
+        return pid;
+    }
+
+    pid_t pid = spawn_exec(path, argv, in, out, r, n);
+
+    // posix_spawn hands us the exec error directly, so a stale cached path
+    // can be fixed up and retried right here
+    if (pid == -1 && errno == ENOENT && path != argv[0])
+    {
+        hash_forget(argv[0]);
+        path = hash_lookup(argv[0]);
+        if (path != NULL)
+            pid = spawn_exec(path, argv, in, out, r, n);
+        else
+            errno = ENOENT;
+    }
+    redirect_close(r, n);
+    TRACE_END_ARG("spawn", t, pid, argv[0]);
+
+    if (pid == -1)
+    {
+        start_failure = errno == ENOENT ? 127 : 126;
+        if (errno == ENOENT)
+            fprintf(stderr, "%s: Command not found.\n", argv[0]);
+        else
+            perror(argv[0]);
+    }
+
+    return pid;
+}
+
+// Start one stage of a pipeline and return its pid, or -1 if it could not be
+// started, with start_failure set to what it counts as exiting with. Never
+// waits for it
+pid_t start_stage(char **argv, int in, int out, struct redirect *r, size_t n)
+{
+    if (strcmp(argv[0], "limit"))
+        return start_command(argv, in, out, r, n);
+
+    char **cmd = parse_limits(argv);
+    if (cmd == NULL)
+    {
+        start_failure = 2;
+        return -1;
+    }
+    pid_t pid = start_command(cmd, in, out, r, n);
+    clear_limits();
+    return pid;
+}
+
+// Run the parsed pipeline as a new job. Every stage is started right away
+// with its stdout connected to the next stage's stdin, then we wait for the
+// whole group unless it was sent to the background. The pids of the stages
+// that started are recorded in `entry`. Returns the wait status of the last
+// stage (made up if nothing could be started), 0 for a background job, or
+// -1 if the job got stopped
+int run_external(struct command *entry)
+{
+    pid_t *pids = arena_alloc(&line_arena, stage_count * sizeof(*pids));
+    struct job *job = new_job(entry, stage_count);
+    if (pids == NULL || job == NULL)
+    {
+        fputs("msh: out of memory\n", stderr);
+        if (job != NULL)
+            free_job(job);
+        return W_EXITCODE(1, 0);
+    }
+
+    // Anything we printed ourselves has to come out before the child's output
+    fflush(stdout);
+    reader_release_stdin();
+
+    // A background job must not fight us for whatever is on stdin
+    int in = -1;
+    if (background)
+        in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    for (size_t i = 0; i < stage_count; ++i)
+        pids[i] = -1;
+
+    // The first stage that starts makes the job's group, the rest join it
+    if (JOB_CONTROL)
+    {
+        stage_pgid = 0;
+        stage_foreground = !background;
+    }
+
+    for (size_t i = 0, r = 0; i < stage_count; ++i)
+    {
+        // This stage's redirections come next in the list
+        size_t first = r;
+        while (r < redir_count && redirs[r].stage == i)
+            r++;
+
+        // The pipes are close-on-exec, so once a stage has dup2'd its ends
+        // onto stdin/stdout no child ends up holding a stray copy
+        int fds[2] = {-1, -1};
+        if (i + 1 < stage_count && pipe2(fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe");
+            break;
+        }
+
+        pids[i] = start_stage(stages[i], in, fds[1], redirs + first, r - first);
+        if (pids[i] != -1)
+        {
+            job_add_proc(job, pids[i]);
+            if (JOB_CONTROL && job->pgid == 0)
+                job->pgid = stage_pgid = pids[i];
+        }
+
+        // The children have their copies now. Closing ours is what lets the
+        // reader see EOF once the writer exits
+        if (in != -1)
+            close(in);
+        if (fds[1] != -1)
+            close(fds[1]);
+        in = fds[0];
+    }
+    if (in != -1)
+        close(in);
+    stage_pgid = -1;
+    stage_foreground = false;
+
+    // Every pipeline of the line adds its pids to the same entry
+    pid_t *all = NULL;
+    if (job->nprocs > 0 && (all = realloc(entry->pids, (entry->npids + job->nprocs) * sizeof(*all))) != NULL)
+    {
+        entry->pids = all;
+        for (size_t i = 0; i < job->nprocs; ++i)
+            entry->pids[entry->npids++] = job->procs[i].pid;
+    }
+
+    if (job->nprocs == 0)
+    {
+        // Same as what a child would have exited with if exec failed
+        free_job(job);
+        entry->status = W_EXITCODE(start_failure, 0);
+        return entry->status;
+    }
+
+    if (background)
+    {
+        job->background = true;
+        defer_job(job);
+        if (interactive)
+            printf("[%d] %d\n", job->id, job->procs[job->nprocs - 1].pid);
+        return 0;
+    }
+
+    // The first stage may have taken the terminal itself already, but with
+    // the fork engine it might not have got that far yet
+    if (JOB_CONTROL)
+        tcsetpgrp(shell_terminal, job->pgid);
+
+    long long t = TRACE_BEGIN();
+    wait_for_job(job);
+    TRACE_END("wait", t);
+
+    // 127 is what the fork engine exits with when exec fails. Only then is it
+    // worth checking whether the path we handed out has disappeared
+    for (size_t i = 0, j = 0; !USE_POSIX_SPAWN && i < stage_count; ++i)
+    {
+        if (pids[i] == -1)
+            continue;
+
+        struct job_proc *proc = &job->procs[j++];
+        if (proc->done && WIFEXITED(proc->status) && WEXITSTATUS(proc->status) == 127)
+        {
+            struct hash_entry *e = hash_find(stages[i][0]);
+            if (e != NULL && access(e->path, X_OK) == -1)
+                hash_forget(stages[i][0]);
+        }
+    }
+
+    return finish_foreground(job);
+}
+
+/*
+ * parallel builtin
+ *
+ *     parallel [-j N] [-k] command [args...] [::: input...]
+ *
+ * Runs `command` once for every input, with each `{}` in its arguments
+ * replaced by the input (or the input tacked on the end if there is no
+ * `{}`). Inputs come after `:::`, or one per line from stdin without it. At
+ * most N commands run at once (the number of CPUs by default) and a new one
+ * is started as soon as one exits. With -k every command's output is
+ * collected and printed in input order instead of as it happens.
+ *
+ * With job control the run is a job of its own like any external command,
+ * in a forked copy of the shell that its commands share a process group
+ * with. ^Z then stops all of it, and fg carries on where it left off.
+ */
+struct parallel_task
+{
+    const char *input;
+    ssize_t proc;    // Index into the job's procs, -1 if it never started
+    int out;         // Read end of its stdout with -k, -1 once at EOF
+    char *buf;       // What it printed so far with -k
+    size_t len;
+    size_t cap;
+};
+
+bool parallel_task_done(const struct job *job, const struct parallel_task *task)
+{
+    return task->out == -1 && (task->proc == -1 || job->procs[task->proc].done);
+}
+
+// Build the argv for one input. It only has to live until the command is
+// started, so it goes in the line arena with everything else of this line
+char **parallel_argv(char **tmpl, size_t ntmpl, const char *input)
+{
+    bool placeholder = false;
+    size_t input_len = strlen(input);
+
+    char **argv = arena_alloc(&line_arena, (ntmpl + 2) * sizeof(*argv));
+    if (argv == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < ntmpl; ++i)
+    {
+        // Count the {}s first so the result can be allocated in one go
+        size_t n = 0;
+        for (const char *p = tmpl[i]; (p = strstr(p, "{}")) != NULL; p += 2)
+            n++;
+
+        if (n == 0)
+        {
+            argv[i] = tmpl[i];
+            continue;
+        }
+
+        placeholder = true;
+        char *arg = arena_alloc(&line_arena, strlen(tmpl[i]) + n * input_len + 1);
+        if (arg == NULL)
+            return NULL;
+
+        char *out = arg;
+        const char *p = tmpl[i], *brace;
+        while ((brace = strstr(p, "{}")) != NULL)
+        {
+            memcpy(out, p, brace - p);
+            out += brace - p;
+            memcpy(out, input, input_len);
+            out += input_len;
+            p = brace + 2;
+        }
+        strcpy(out, p);
+        argv[i] = arg;
+    }
+
+    argv[ntmpl] = placeholder ? NULL : (char *)input;
+    argv[ntmpl + 1] = NULL;
+    return argv;
+}
+
+// What parallel_pump polls, allocated once for the run. Only a task that is
+// still active has its pipe open, so there are never more than -j of them
+struct parallel_poll
+{
+    struct pollfd *fds;
+    size_t *owner; // The task each of fds belongs to
+    size_t cap;
+};
+
+// Read whatever the -k pipes have for us. SIGCHLD stays blocked except while
+// we sleep in ppoll, so a child exiting always wakes us up to refill its slot
+void parallel_pump(struct parallel_poll *pump, struct parallel_task *tasks, size_t first,
+                   size_t last)
+{
+    struct pollfd *fds = pump->fds;
+    size_t *owner = pump->owner;
+    size_t nfds = 0;
+
+    for (size_t i = first; i < last && nfds < pump->cap; ++i)
+    {
+        if (tasks[i].out == -1)
+            continue;
+        fds[nfds].fd = tasks[i].out;
+        fds[nfds].events = POLLIN;
+        owner[nfds++] = i;
+    }
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    if (!children_changed && ppoll(fds, nfds, NULL, &old) > 0)
+    {
+        for (size_t i = 0; i < nfds; ++i)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            struct parallel_task *task = &tasks[owner[i]];
+            if (task->cap - task->len < READ_BUFFER_SIZE)
+            {
+                size_t cap = task->cap ? task->cap * 2 : READ_BUFFER_SIZE;
+                while (cap - task->len < READ_BUFFER_SIZE)
+                    cap *= 2;
+
+                char *buf = realloc(task->buf, cap);
+                if (buf == NULL)
+                    continue;
+                task->buf = buf;
+                task->cap = cap;
+            }
+
+            ssize_t n = read(task->out, task->buf + task->len, task->cap - task->len);
+            if (n > 0)
+                task->len += n;
+            else if (n == 0 || errno != EINTR)
+            {
+                close(task->out);
+                task->out = -1;
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    reap_children();
+}
+
+int run_parallel(char **argv)
+{
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_order = false;
+    int i = 1;
+
+    for (; argv[i] != NULL && argv[i][0] == '-'; ++i)
+    {
+        if (!strcmp(argv[i], "-k"))
+            keep_order = true;
+        else if (!strncmp(argv[i], "-j", 2))
+        {
+            const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+            max_jobs = n ? strtol(n, NULL, 10) : 0;
+            if (max_jobs <= 0)
+            {
+                fputs("parallel: -j needs a positive number\n", stderr);
+                return 2;
+            }
+        }
+        else if (!strcmp(argv[i], "--"))
+        {
+            i++;
+            break;
+        }
+        else
+        {
+            fprintf(stderr, "parallel: unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (max_jobs <= 0)
+        max_jobs = 1;
+
+    char **tmpl = &argv[i];
+    size_t ntmpl = 0;
+    while (tmpl[ntmpl] != NULL && strcmp(tmpl[ntmpl], ":::"))
+        ntmpl++;
+
+    if (ntmpl == 0)
+    {
+        fputs("usage: parallel [-j N] [-k] command [args...] [::: input...]\n", stderr);
+        return 2;
+    }
+
+    // The inputs are either the rest of the arguments or the lines of stdin.
+    // If stdin is where our own commands come from, take them from our
+    // reader so nothing it already buffered gets lost
+    char **inputs = NULL;
+    size_t ninputs = 0;
+    bool from_stdin = tmpl[ntmpl] == NULL;
+
+    if (!from_stdin)
+    {
+        inputs = &tmpl[ntmpl + 1];
+        while (inputs[ninputs] != NULL)
+            ninputs++;
+    }
+    else
+    {
+        struct line_reader stdin_reader = {0};
+        struct line_reader *r = &input;
+        if (input.fd != STDIN_FILENO)
+        {
+            r = &stdin_reader;
+            reader_open_fd(r, STDIN_FILENO);
+        }
+
+        size_t cap = 0;
+        char *line;
+        while ((line = reader_getline(r)) != NULL)
+        {
+            if (ninputs == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                char **grown = realloc(inputs, cap * sizeof(*inputs));
+                if (grown == NULL)
+                    break;
+                inputs = grown;
+            }
+            inputs[ninputs] = arena_alloc(&line_arena, strlen(line) + 1);
+            if (inputs[ninputs] == NULL)
+                break;
+            strcpy(inputs[ninputs++], line);
+        }
+
+        // A terminal can still be typed at after ^D
+        if (r == &input && interactive)
+            input.eof = false;
+        free(stdin_reader.buf);
+    }
+
+    // The whole run is one job with a process per input, which is also how
+    // it shows up in history -p
+    struct command *entry = hist_ptr >= 0 ? &history[hist_ptr] : NULL;
+    struct job *job = new_job(entry, ninputs);
+    struct parallel_task *tasks = calloc(ninputs ? ninputs : 1, sizeof(*tasks));
+    struct parallel_poll pump = {0};
+    if (keep_order)
+    {
+        pump.cap = (size_t)max_jobs < ninputs ? (size_t)max_jobs : ninputs;
+        pump.fds = malloc((pump.cap ? pump.cap : 1) * sizeof(*pump.fds));
+        pump.owner = malloc((pump.cap ? pump.cap : 1) * sizeof(*pump.owner));
+    }
+    if (job == NULL || tasks == NULL || (keep_order && (pump.fds == NULL || pump.owner == NULL)))
+    {
+        fputs("parallel: out of memory\n", stderr);
+        if (job != NULL)
+            free_job(job);
+        free(tasks);
+        free(pump.fds);
+        free(pump.owner);
+        if (from_stdin)
+            free(inputs);
+        return 1;
+    }
+
+    // Earlier pipelines on the line have their pids in there already
+    bool keep_pids = false;
+    if (entry != NULL && ninputs > 0)
+    {
+        pid_t *pids = realloc(entry->pids, (entry->npids + ninputs) * sizeof(*pids));
+        if ((keep_pids = pids != NULL))
+            entry->pids = pids;
+    }
+
+    // The commands can't have our stdin if that is where the inputs came from
+    int in = from_stdin ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+
+    fflush(stdout);
+    reader_release_stdin();
+
+    size_t next = 0, first = 0, printed = 0;
+    while (1)
+    {
+        // Skip over everything that is finished at the front of the window
+        while (first < next && parallel_task_done(job, &tasks[first]))
+            first++;
+
+        size_t active = 0;
+        for (size_t t = first; t < next; ++t)
+        {
+            if (!parallel_task_done(job, &tasks[t]))
+                active++;
+        }
+
+        // Keep max_jobs of them in flight
+        for (; next < ninputs && active < (size_t)max_jobs; ++next, ++active)
+        {
+            struct parallel_task *task = &tasks[next];
+            task->input = inputs[next];
+            task->proc = -1;
+            task->out = -1;
+
+            char **targv = parallel_argv(tmpl, ntmpl, task->input);
+            int fds[2] = {-1, -1};
+            if (targv == NULL || (keep_order && pipe2(fds, O_CLOEXEC) == -1))
+            {
+                perror("parallel");
+                continue;
+            }
+
+            pid_t pid = start_stage(targv, in, fds[1], NULL, 0);
+            if (fds[1] != -1)
+                close(fds[1]);
+
+            if (pid == -1)
+            {
+                if (fds[0] != -1)
+                    close(fds[0]);
+                continue;
+            }
+
+            task->proc = job->nprocs;
+            task->out = fds[0];
+            job_add_proc(job, pid);
+            if (keep_pids)
+                entry->pids[entry->npids++] = pid;
+        }
+
+        // With -k, print every finished command's output as soon as all the
+        // ones before it have been printed
+        for (; keep_order && printed < next && parallel_task_done(job, &tasks[printed]); ++printed)
+        {
+            fwrite(tasks[printed].buf, 1, tasks[printed].len, stdout);
+            free(tasks[printed].buf);
+            tasks[printed].buf = NULL;
+        }
+        fflush(stdout);
+
+        if (active == 0 && next == ninputs)
+            break;
+
+        if (keep_order)
+            parallel_pump(&pump, tasks, first, next);
+        else if (!wait_one_child())
+            break;
+    }
+
+    if (in != -1)
+        close(in);
+
+    // Every command's exit status gets checked, only the failures are worth
+    // talking about
+    size_t failed = 0;
+    for (size_t t = 0; t < ninputs; ++t)
+    {
+        int status = tasks[t].proc == -1 ? -1 : job->procs[tasks[t].proc].status;
+        if (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+
+        failed++;
+        if (status == -1)
+            fprintf(stderr, "parallel: %s: did not start\n", tasks[t].input);
+        else if (WIFSIGNALED(status))
+            fprintf(stderr, "parallel: %s: killed by signal %d\n", tasks[t].input,
+                    WTERMSIG(status));
+        else
+            fprintf(stderr, "parallel: %s: exited with %d\n", tasks[t].input,
+                    WEXITSTATUS(status));
+    }
+    if (failed)
+        fprintf(stderr, "parallel: %zu of %zu failed\n", failed, ninputs);
+
+    for (size_t t = 0; t < ninputs; ++t)
+    {
+        free(tasks[t].buf);
+        if (tasks[t].out != -1)
+            close(tasks[t].out);
+    }
+    free(tasks);
+    free(pump.fds);
+    free(pump.owner);
+    free_job(job);
+    if (from_stdin)
+        free(inputs);
+
+    // The CPU time and RSS of the whole run came from the job, but its status
+    // is whether everything worked, not how the last command did
+    if (entry != NULL && ninputs > 0)
+        entry->status = W_EXITCODE(failed ? 1 : 0, 0);
+    return failed ? 1 : 0;
+}
+
+// `[pid]` for a simple command, `[pid pid ...]` for a pipeline and `[-1]`
+// when nothing was started
+void print_pids(const struct command *entry)
+{
+    if (entry->npids == 0)
+    {
+        printf("[%d] ", -1);
+        return;
+    }
+
+    putchar('[');
+    for (size_t i = 0; i < entry->npids; ++i)
+        printf(i ? " %d" : "%d", entry->pids[i]);
+    fputs("] ", stdout);
+}
+
+// Exit code, `sigN` if it was killed, or `-` if it never ran or is still
+// running
+void print_status(int status)
+{
+    if (status == -1)
+        printf("%7s", "-");
+    else if (WIFSIGNALED(status))
+        printf("%4s%-3d", "sig", WTERMSIG(status));
+    else
+        printf("%7d", WEXITSTATUS(status));
+}
+
+void print_times(const struct command *entry)
+{
+    print_status(entry->status);
+    printf(" %9.3f %9.3f %9.3f %8ld  ", entry->wall_us / 1e6, entry->user_us / 1e6,
+           entry->sys_us / 1e6, entry->maxrss_kb);
+}
+
+void print_history(bool showpid, bool showtimes)
+{
+    // If the pointer is at the last element in the list or the list isn't
+    // full yet, the history runs from the first element to the current one
+    // pointed by `hist_ptr`. Else it starts right after the current one and
+    // loops around the list
+    int first = 0, count = hist_ptr + 1;
+    if (hist_ptr != HISTORY_SIZE - 1 && history[hist_ptr + 1].cmd != NULL)
+    {
+        first = hist_ptr + 1;
+        count = HISTORY_SIZE;
+    }
+
+    if (showtimes)
+        printf("     %7s %9s %9s %9s %8s  %s\n", "status", "real", "user", "sys", "maxrss",
+               "command");
+
+    for (int i = first, j = 0; j < count; ++i, ++j)
+    {
+        if (i == HISTORY_SIZE)
+            i = 0;
+
+        printf("[%2d] ", j);
+
+        // Choose to showpid or not
+        if (showpid)
+            print_pids(&history[i]);
+        if (showtimes)
+            print_times(&history[i]);
+
+        printf("%s\n", history[i].cmd);
+    }
+}
+
+/*
+ * Working directory
+ *
+ * The shell keeps track of where it is itself, the way other shells do.
+ * cd works on the logical path, the one the user typed their way down, so
+ * `cd ..` out of a symlinked directory goes back where it came from. PWD
+ * and OLDPWD follow along, and the prompt is rebuilt only when this
+ * changes, so drawing it never has to ask the kernel where we are. That is
+ * a getcwd walk up the tree, and on a deep NFS path every step of it is a
+ * round trip.
+ *
+ * pushd, popd and dirs keep a stack of directories under the current one,
+ * shown with the top first like in bash.
+ */
+struct cwd_state
+{
+    char *path;       // NULL if we can't tell
+    char **stack;     // Top of the stack last
+    size_t count, cap;
+};
+
+struct cwd_state cwd = {0};
+
+// `dir` made absolute against the logical cwd, with `.`, `..` and repeated
+// slashes worked out on the string alone
+char *logical_path(const char *dir)
+{
+    const char *base = dir[0] == '/' ? "" : cwd.path;
+    char *path = malloc(strlen(base) + strlen(dir) + 3);
+    if (path == NULL)
+        return NULL;
+    sprintf(path, "%s/%s", base, dir);
+
+    // The cleaned up path is never longer than what is left to look at, so
+    // it is built over the start of the same buffer
+    char *w = path;
+    for (char *r = path; *r != '\0';)
+    {
+        r += strspn(r, "/");
+        size_t len = strcspn(r, "/");
+        if (len == 2 && r[0] == '.' && r[1] == '.')
+        {
+            while (w > path && *--w != '/')
+                ;
+        }
+        else if (len > 0 && !(len == 1 && r[0] == '.'))
+        {
+            *w++ = '/';
+            memmove(w, r, len);
+            w += len;
+        }
+        r += len;
+    }
+    if (w == path)
+        *w++ = '/';
+    *w = '\0';
+    return path;
+}
+
+// We are in `path` now, which is ours to keep
+void set_cwd(char *path)
+{
+    if (cwd.path != NULL)
+        env_set("OLDPWD", 6, cwd.path);
+    free(cwd.path);
+    cwd.path = path;
+    if (path != NULL)
+        env_set("PWD", 3, path);
+    refresh_prompt();
+}
+
+void init_cwd()
+{
+    // An inherited PWD is good as long as it really is here, and it is the
+    // logical path our parent had
+    const char *env = env_get("PWD");
+    struct stat a, b;
+    if (env != NULL && env[0] == '/' && stat(env, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+        cwd.path = logical_path(env);
+    else
+        cwd.path = pwd();
+
+    if (cwd.path != NULL)
+        env_set("PWD", 3, cwd.path);
+}
+
+void free_cwd()
+{
+    free(cwd.path);
+    for (size_t i = 0; i < cwd.count; ++i)
+        free(cwd.stack[i]);
+    free(cwd.stack);
+}
+
+// cd, pushd and popd all end up here
+bool change_dir(const char *dir)
+{
+    char *path = cwd.path != NULL ? logical_path(dir) : NULL;
+    if (path != NULL && chdir(path) == 0)
+    {
+        set_cwd(path);
+        return true;
+    }
+    free(path);
+
+    // Where we are is anyone's guess, or the logical path is gone but the
+    // physical one is still there
+    if (chdir(dir) == 0)
+    {
+        set_cwd(pwd());
+        return true;
+    }
+    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+    return false;
+}
+
+// A directory the way dirs shows it, with the home directory as ~
+void print_dir(const char *dir)
+{
+    if (dir == NULL)
+    {
+        fputs("<nowhere>", stdout);
+        return;
+    }
+
+    const char *home = env_get("HOME");
+    if (home == NULL)
+        home = prompt.home;
+
+    size_t n = home ? strlen(home) : 0;
+    if (n > 1 && !strncmp(dir, home, n) && (dir[n] == '/' || dir[n] == '\0'))
+        printf("~%s", dir + n);
+    else
+        fputs(dir, stdout);
+}
+
+void print_dirs()
+{
+    print_dir(cwd.path);
+    for (size_t i = cwd.count; i-- > 0;)
+    {
+        putchar(' ');
+        print_dir(cwd.stack[i]);
+    }
+    putchar('\n');
+}
+
+bool push_dir(char *dir)
+{
+    if (cwd.count == cwd.cap)
+    {
+        size_t cap = cwd.cap ? cwd.cap * 2 : 8;
+        char **stack = realloc(cwd.stack, cap * sizeof(*stack));
+        if (stack == NULL)
+            return false;
+        cwd.stack = stack;
+        cwd.cap = cap;
+    }
+    cwd.stack[cwd.count++] = dir;
+    return true;
+}
+
+/*
+ * Builtins
+ *
+ * Every builtin is a function from argc/argv to an exit status, found by
+ * name with a binary search of the table at the end. Trivial commands like
+ * true, echo and test are builtins too, since a script full of them would
+ * otherwise spend nearly all of its time in fork and exec.
+ */
+// Output goes through stdio, so a write error only shows up once it is
+// flushed. That is still well before the command counts as done
+int builtin_flush(const char *name)
+{
+    if (fflush(stdout) == EOF)
+    {
+        fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+        clearerr(stdout);
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_history(int argc, char **argv)
+{
+    // Print the history, -p adds the pids and -t what each command cost.
+    // -a is everything in the log instead of just the last few
+    bool showpid = false, showtimes = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-a"))
+        {
+            print_history_log();
+            return 0;
+        }
+        else if (!strcmp(argv[i], "-s"))
+        {
+            if (argv[i + 1] == NULL)
+            {
+                fputs("history: -s needs a pattern\n", stderr);
+                return 2;
+            }
+            print_history_search(argv[i + 1]);
+            return 0;
+        }
+        else if (!strcmp(argv[i], "-p"))
+            showpid = true;
+        else if (!strcmp(argv[i], "-t"))
+            showtimes = true;
+        else
+        {
+            fprintf(stderr, "history: unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    print_history(showpid, showtimes);
+    return 0;
+}
+
+int builtin_hash(int argc, char **argv)
+{
+    // With no args show the table, -r forgets everything, and names
+    // get looked up and remembered right away
+    if (argc == 1)
+        print_hash_table();
+    else if (!strcmp(argv[1], "-r"))
+        hash_forget_all();
+    else
+    {
+        int status = 0;
+        for (int i = 1; i < argc; ++i)
+        {
+            hash_forget(argv[i]);
+            if (hash_lookup(argv[i]) == NULL)
+            {
+                fprintf(stderr, "hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+            else
+                hash_find(argv[i])->hits = 0;
+        }
+        return status;
+    }
+    return 0;
+}
+
+int builtin_cd(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Too many args for cd command\n");
+        return 1;
+    }
+
+    char *dir = argv[1];
+    bool back = dir != NULL && !strcmp(dir, "-");
+    if (back && (dir = (char *)env_get("OLDPWD")) == NULL)
+    {
+        fputs("cd: OLDPWD not set\n", stderr);
+        return 1;
+    }
+    if (dir == NULL)
+    {
+        // Try to cd to the user's home directory. We do this through
+        // the environment variable "HOME"
+        // There is a better way to get home directory but if some major
+        // shells use this, who am I to not do the same
+        dir = (char *)env_get("HOME");
+        if (dir == NULL)
+            dir = prompt.home;
+        if (dir == NULL)
+        {
+            fputs("msh: cd: HOME not set\n", stderr);
+            return 1;
+        }
+    }
+
+    // The string is OLDPWD's, which is about to be replaced
+    char *copy = back ? strdup(dir) : NULL;
+    if (back && copy == NULL)
+    {
+        fputs("msh: out of memory\n", stderr);
+        return 1;
+    }
+    bool ok = change_dir(back ? copy : dir);
+    free(copy);
+    if (!ok)
+        return 1;
+
+    // `cd -` says where it went
+    if (back)
+    {
+        puts(cwd.path ? cwd.path : "<nowhere>");
+        return builtin_flush(argv[0]);
+    }
+    return 0;
+}
+
+// pushd dir: cd to dir and put where we were on the stack. pushd on its
+// own swaps the current directory with the top of the stack
+int builtin_pushd(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fputs("pushd: too many arguments\n", stderr);
+        return 1;
+    }
+    if (argc == 1 && cwd.count == 0)
+    {
+        fputs("pushd: no other directory\n", stderr);
+        return 1;
+    }
+
+    char *here = cwd.path ? strdup(cwd.path) : pwd();
+    if (here == NULL)
+        return 1;
+
+    char *dir = argc > 1 ? argv[1] : cwd.stack[cwd.count - 1];
+    if (!change_dir(dir))
+    {
+        free(here);
+        return 1;
+    }
+
+    if (argc == 1)
+    {
+        free(cwd.stack[cwd.count - 1]);
+        cwd.stack[cwd.count - 1] = here;
+    }
+    else if (!push_dir(here))
+    {
+        free(here);
+        fputs("msh: out of memory\n", stderr);
+        return 1;
+    }
+
+    print_dirs();
+    return builtin_flush(argv[0]);
+}
+
+int builtin_popd(int argc, char **argv)
+{
+    (void)argc;
+    if (cwd.count == 0)
+    {
+        fputs("popd: directory stack empty\n", stderr);
+        return 1;
+    }
+    if (!change_dir(cwd.stack[cwd.count - 1]))
+        return 1;
+
+    free(cwd.stack[--cwd.count]);
+    print_dirs();
+    return builtin_flush(argv[0]);
+}
+
+// dirs lists the stack, -c clears it
+int builtin_dirs(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "-c"))
+    {
+        while (cwd.count > 0)
+            free(cwd.stack[--cwd.count]);
+        return 0;
+    }
+
+    print_dirs();
+    return builtin_flush(argv[0]);
+}
+
+int builtin_jobs(int argc, char **argv)
+{
+    // -l adds the pids of every process in the job
+    bool pids = argc > 1 && !strcmp(argv[1], "-l");
+
+    reap_children();
+    for (size_t i = 0; i < jobs_cap; ++i)
+    {
+        if (jobs[i].id != 0 && jobs[i].background)
+            print_job(&jobs[i], pids);
+    }
+    return 0;
+}
+
+// The exit status a shell reports for a wait status
+int exit_code(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 128 + WSTOPSIG(status);
+}
+
+// fg and bg
+int builtin_fg(int argc, char **argv)
+{
+    (void)argc;
+    const char *cmd = argv[0];
+    struct job *job = find_job(argv[1]);
+    if (job == NULL || !job->background)
+    {
+        fprintf(stderr, "%s: %s: no such job\n", cmd, argv[1] ? argv[1] : "current");
+        return 1;
+    }
+
+    if (*cmd == 'f')
+    {
+        puts(job->cmd);
+        fflush(stdout);
+
+        int status = foreground_job(job);
+        return status == -1 ? 0 : exit_code(status);
+    }
+
+    if (job->stopped)
+        continue_job(job);
+    printf("[%d]  %s &\n", job->id, job->cmd);
+    return 0;
+}
+
+int builtin_parallel(int argc, char **argv)
+{
+    (void)argc;
+    return run_parallel(argv);
+}
+
+int builtin_wait(int argc, char **argv)
+{
+    // Stopped jobs would never finish, so plain `wait` leaves them alone.
+    // A job whose status `wait` collected is forgotten like a foreground one,
+    // rather than reported as Done at the next prompt
+    if (argc == 1)
+    {
+        for (size_t i = 0; i < jobs_cap; ++i)
+        {
+            if (jobs[i].id != 0 && jobs[i].background && !jobs[i].stopped)
+            {
+                wait_for_job(&jobs[i]);
+                if (jobs[i].nalive == 0)
+                    free_job(&jobs[i]);
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        struct job *job = NULL;
+
+        // Either a job spec or the pid of any process in the job
+        if (*argv[i] == '%')
+            job = find_job(argv[i]);
+        else
+        {
+            pid_t pid = atoi(argv[i]);
+            for (size_t j = 0; job == NULL && j < jobs_cap; ++j)
+            {
+                for (size_t k = 0; jobs[j].id != 0 && k < jobs[j].nprocs; ++k)
+                {
+                    if (jobs[j].procs[k].pid == pid)
+                        job = &jobs[j];
+                }
+            }
+        }
+
+        if (job == NULL)
+        {
+            fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+            status = 127;
+        }
+        else
+        {
+            wait_for_job(job);
+            status = exit_code(job_status(job));
+            if (job->nalive == 0)
+                free_job(job);
+        }
+    }
+    return status;
+}
+
+// echo [-n] [-e] args. -e understands the usual backslash escapes, and \c
+// stops the output right there
+int builtin_echo(int argc, char **argv)
+{
+    bool newline = true, escapes = false;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        const char *opt = argv[i] + 1;
+        if (strspn(opt, "neE") != strlen(opt))
+            break;
+
+        for (; *opt; ++opt)
+        {
+            if (*opt == 'n')
+                newline = false;
+            else
+                escapes = *opt == 'e';
+        }
+    }
+
+    for (bool first = true; i < argc; ++i, first = false)
+    {
+        if (!first)
+            putchar(' ');
+
+        if (!escapes)
+        {
+            fputs(argv[i], stdout);
+            continue;
+        }
+
+        for (const char *p = argv[i]; *p; ++p)
+        {
+            if (*p != '\\' || p[1] == '\0')
+            {
+                putchar(*p);
+                continue;
+            }
+
+            switch (*++p)
+            {
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'e': putchar('\x1b'); break;
+            case 'f': putchar('\f'); break;
+            case 'n': putchar('\n'); break;
+            case 'r': putchar('\r'); break;
+            case 't': putchar('\t'); break;
+            case 'v': putchar('\v'); break;
+            case '\\': putchar('\\'); break;
+            case 'c':
+                return builtin_flush(argv[0]);
+            case '0':
+            {
+                // Up to three octal digits after the 0
+                int c = 0;
+                for (int n = 0; n < 3 && p[1] >= '0' && p[1] <= '7'; ++n)
+                    c = c * 8 + *++p - '0';
+                putchar(c);
+                break;
+            }
+            default:
+                putchar('\\');
+                putchar(*p);
+                break;
+            }
+        }
+    }
+
+    if (newline)
+        putchar('\n');
+    return builtin_flush(argv[0]);
+}
+
+// Names sort before anything longer that starts with them
+int env_compare(const void *a, const void *b)
+{
+    const char *x = *(char *const *)a, *y = *(char *const *)b;
+    for (; *x == *y && *x != '='; ++x, ++y)
+        ;
+    return (*x == '=' ? 0 : (unsigned char)*x) - (*y == '=' ? 0 : (unsigned char)*y);
+}
+
+// Every variable, sorted, in a form that can be pasted back in
+void print_env()
+{
+    char **envp = env_envp();
+    size_t n = 0;
+    while (envp[n] != NULL)
+        n++;
+
+    char **sorted = malloc((n ? n : 1) * sizeof(*sorted));
+    if (sorted == NULL)
+    {
+        fputs("export: out of memory\n", stderr);
+        return;
+    }
+    memcpy(sorted, envp, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), env_compare);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        const char *eq = strchr(sorted[i], '=');
+        printf("export %.*s='", (int)(eq - sorted[i]), sorted[i]);
+        for (const char *c = eq + 1; *c; ++c)
+        {
+            if (*c == '\'')
+                fputs("'\\''", stdout);
+            else
+                putchar(*c);
+        }
+        puts("'");
+    }
+    free(sorted);
+}
+
+// export [NAME=value]... Every variable is exported already, so a bare NAME
+// has nothing to do
+int builtin_export(int argc, char **argv)
+{
+    if (argc == 1)
+    {
+        print_env();
+        return builtin_flush(argv[0]);
+    }
+
+    int status = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *eq = strchr(argv[i], '=');
+        size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+        if (!env_valid_name(argv[i], len))
+        {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+        }
+        else if (eq != NULL && !env_set(argv[i], len, eq + 1))
+        {
+            perror("export");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int builtin_unset(int argc, char **argv)
+{
+    int status = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!env_valid_name(argv[i], strlen(argv[i])))
+        {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+        }
+        else
+            env_unset(argv[i]);
+    }
+    return status;
+}
+
+// The logical cwd we keep track of, -P asks the kernel for the real one
+int builtin_pwd(int argc, char **argv)
+{
+    if (cwd.path != NULL && !(argc > 1 && !strcmp(argv[1], "-P")))
+    {
+        puts(cwd.path);
+        return builtin_flush(argv[0]);
+    }
+
+    char *dir = pwd();
+    if (dir == NULL)
+        return 1;
+
+    puts(dir);
+    free(dir);
+    return builtin_flush(argv[0]);
+}
+
+int builtin_true(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    return 0;
+}
+
+int builtin_false(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    return 1;
+}
+
+/*
+ * test and [
+ *
+ * What an expression means is decided by how many arguments it has, the way
+ * POSIX lays it out, so `test -n` is a one argument test of the string "-n"
+ * and not a broken unary one. Returns 0 for true, 1 for false and 2 for an
+ * expression that doesn't make sense.
+ */
+int test_expr(int argc, char **argv);
+
+bool test_number(const char *s, long long *n)
+{
+    char *end;
+    errno = 0;
+    *n = strtoll(s, &end, 10);
+    if (errno || end == s || *end != '\0')
+    {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        return false;
+    }
+    return true;
+}
+
+// -1 if `op` isn't a unary operator
+int test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+        return -1;
+
+    switch (op[1])
+    {
+    case 'z': return *arg != '\0';
+    case 'n': return *arg == '\0';
+    case 'e': return stat(arg, &st) != 0;
+    case 'f': return stat(arg, &st) != 0 || !S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) != 0 || !S_ISDIR(st.st_mode);
+    case 'b': return stat(arg, &st) != 0 || !S_ISBLK(st.st_mode);
+    case 'c': return stat(arg, &st) != 0 || !S_ISCHR(st.st_mode);
+    case 'p': return stat(arg, &st) != 0 || !S_ISFIFO(st.st_mode);
+    case 'S': return stat(arg, &st) != 0 || !S_ISSOCK(st.st_mode);
+    case 's': return stat(arg, &st) != 0 || st.st_size == 0;
+    case 'h':
+    case 'L': return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) != 0;
+    case 'w': return access(arg, W_OK) != 0;
+    case 'x': return access(arg, X_OK) != 0;
+    case 't':
+    {
+        long long fd;
+        if (!test_number(arg, &fd))
+            return 2;
+        return fd < 0 || fd > INT_MAX || !isatty(fd);
+    }
+    }
+    return -1;
+}
+
+// -1 if `op` isn't a binary operator
+int test_binary(const char *a, const char *op, const char *b)
+{
+    if (!strcmp(op, "=") || !strcmp(op, "=="))
+        return strcmp(a, b) != 0;
+    if (!strcmp(op, "!="))
+        return strcmp(a, b) == 0;
+    if (!strcmp(op, "<"))
+        return strcmp(a, b) >= 0;
+    if (!strcmp(op, ">"))
+        return strcmp(a, b) <= 0;
+
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef"))
+    {
+        struct stat sa, sb;
+        bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+
+        if (op[1] == 'e')
+            return !(ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+
+        // A file that doesn't exist is older than any that does
+        if (op[1] == 'o')
+        {
+            bool hs = ha;
+            ha = hb;
+            hb = hs;
+            struct stat ss = sa;
+            sa = sb;
+            sb = ss;
+        }
+        if (!ha)
+            return 1;
+        if (!hb)
+            return 0;
+        return !(sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                 (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec &&
+                  sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+    }
+
+    static const char *const cmps[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; ++i)
+    {
+        if (strcmp(op, cmps[i]))
+            continue;
+
+        long long x, y;
+        if (!test_number(a, &x) || !test_number(b, &y))
+            return 2;
+
+        bool r = i == 0 ? x == y : i == 1 ? x != y : i == 2 ? x < y :
+                 i == 3 ? x <= y : i == 4 ? x > y : x >= y;
+        return !r;
+    }
+    return -1;
+}
+
+int test_not(int r)
+{
+    return r == 2 ? 2 : !r;
+}
+
+int test_expr(int argc, char **argv)
+{
+    int r;
+
+    switch (argc)
+    {
+    case 0:
+        return 1;
+    case 1:
+        return argv[0][0] == '\0';
+    case 2:
+        if (!strcmp(argv[0], "!"))
+            return test_not(test_expr(1, argv + 1));
+        if ((r = test_unary(argv[0], argv[1])) != -1)
+            return r;
+        fprintf(stderr, "test: %s: unary operator expected\n", argv[0]);
+        return 2;
+    case 3:
+        if ((r = test_binary(argv[0], argv[1], argv[2])) != -1)
+            return r;
+        if (!strcmp(argv[0], "!"))
+            return test_not(test_expr(2, argv + 1));
+        if (!strcmp(argv[0], "(") && !strcmp(argv[2], ")"))
+            return test_expr(1, argv + 1);
+        fprintf(stderr, "test: %s: binary operator expected\n", argv[1]);
+        return 2;
+    case 4:
+        if (!strcmp(argv[0], "!"))
+            return test_not(test_expr(3, argv + 1));
+        if (!strcmp(argv[0], "(") && !strcmp(argv[3], ")"))
+            return test_expr(2, argv + 1);
+        /* fall through */
+    default:
+        fputs("test: too many arguments\n", stderr);
+        return 2;
+    }
+}
+
+int builtin_test(int argc, char **argv)
+{
+    // `[` wants its `]`, which is not part of the expression
+    if (!strcmp(argv[0], "["))
+    {
+        if (strcmp(argv[argc - 1], "]"))
+        {
+            fputs("[: missing `]'\n", stderr);
+            return 2;
+        }
+        argc--;
+    }
+    return test_expr(argc - 1, argv + 1);
+}
+
+// Sorted by name, find_builtin does a binary search
+const struct builtin builtins[] = {
+    {":", builtin_true},
+    {"[", builtin_test},
+    {"bg", builtin_fg},
+    {"cd", builtin_cd},
+    {"dirs", builtin_dirs},
+    {"echo", builtin_echo},
+    {"export", builtin_export},
+    {"false", builtin_false},
+    {"fg", builtin_fg},
+    {"hash", builtin_hash},
+    {"history", builtin_history},
+    {"jobs", builtin_jobs},
+    {"parallel", builtin_parallel},
+    {"popd", builtin_popd},
+    {"pushd", builtin_pushd},
+    {"pwd", builtin_pwd},
+    {"test", builtin_test},
+    {"true", builtin_true},
+    {"unset", builtin_unset},
+    {"wait", builtin_wait},
+};
+
+const size_t builtin_count = sizeof(builtins) / sizeof(*builtins);
+
+int builtin_compare(const void *name, const void *b)
+{
+    return strcmp(name, ((const struct builtin *)b)->name);
+}
+
+const struct builtin *find_builtin(const char *name)
+{
+    return bsearch(name, builtins, builtin_count, sizeof(*builtins), builtin_compare);
+}
+
+bool is_builtin(const char *name)
+{
+    return find_builtin(name) != NULL;
+}
+
+// Run `argv`, which has to be one of our builtins, and return its exit status
+int run_builtin(char **argv)
+{
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+
+    return find_builtin(argv[0])->run(argc, argv);
+}
+
+/*
+ * History expansion
+ *
+ * A line that starts with a history reference is swapped for the command it
+ * refers to before anything gets parsed, so each line is tokenized once and
+ * running it is the same as running any other line.
+ *
+ *   !!       The most recent command
+ *   !n       Command n in the history list
+ *   !prefix  The most recent command that starts with prefix
+ */
+
+// The history slot `!n` refers to, or -1 if the reference is bad
+int history_index(const char *ref)
+{
+    char *endp;
+    unsigned long hist = strtoul(ref, &endp, 10);
+
+    // If something that is not a digit is found, or `n` is out of
+    // bounds, that is an invalid command and we report this
+    if (*endp != '\0' || hist >= HISTORY_SIZE)
+    {
+        fprintf(stderr, "Invalid reference: %s\n", ref);
+        return -1;
+    }
+
+    /* Do some math to calculate the real index */
+
+    // hist_ptr always points to the end of the list so hist_ptr + 1 is
+    // actually the first command in history. Offset that number by
+    // hist and we got our real history index.
+    // **NOTE** we don't need to do that if hist_ptr points to the
+    // bottom of the history array or the history array has less than
+    // HISTORY_SIZE elements
+    if (hist_ptr != HISTORY_SIZE - 1 && history[hist_ptr + 1].cmd != NULL)
+    {
+        hist = hist + hist_ptr + 1;
+
+        if (hist >= HISTORY_SIZE)
+            hist -= HISTORY_SIZE;
+    }
+
+    if (history[hist].cmd == NULL)
+    {
+        fputs("Command not in history\n", stderr);
+        return -1;
+    }
+
+    return hist;
+}
+
+// Returns `line` itself if it doesn't start with a history reference, or the
+// command it refers to with a reference the caller has to drop. NULL if the
+// reference can't be resolved or there is nothing to run
+char *expand_history(char *line)
+{
+    char *cmd = line;
+
+    // Nothing in history is a reference, it is always stored expanded, so
+    // this normally goes around once. The bound only matters for a log that
+    // was edited by hand into a loop
+    for (int hops = 0; hops < HISTORY_SIZE; ++hops)
+    {
+        const char *p = cmd + strspn(cmd, WHITESPACE);
+        if (*p != '!')
+            return cmd;
+
+        // Only the reference itself counts, like it always has. It needs a
+        // terminated copy for strtoul, and the arena is about to be reset
+        // by parse_tokens anyway
+        size_t n = strcspn(p, WHITESPACE "|&");
+        char *ref = arena_alloc(&line_arena, n);
+        char *found = NULL;
+        if (ref == NULL)
+        {
+            fputs("msh: out of memory\n", stderr);
+            if (cmd != line)
+                cmd_unref(cmd);
+            return NULL;
+        }
+        memcpy(ref, p + 1, n - 1);
+        ref[n - 1] = '\0';
+
+        if (*ref == '!')
+        {
+            if (hist_ptr == -1)
+                puts("Command not in history");
+            else
+                found = cmd_ref(history[hist_ptr].cmd);
+        }
+        else if (*ref == '\0')
+        {
+            //ignore '!'
+        }
+        else if (*ref < '0' || *ref > '9')
+        {
+            if ((found = history_find_prefix(ref)) == NULL)
+                fputs("Command not in history\n", stderr);
+        }
+        else
+        {
+            int hist = history_index(ref);
+            if (hist != -1)
+                found = cmd_ref(history[hist].cmd);
+        }
+
+        if (cmd != line)
+            cmd_unref(cmd);
+        if (found == NULL)
+            return NULL;
+        cmd = found;
+    }
+
+    fputs("msh: history reference loop\n", stderr);
+    if (cmd != line)
+        cmd_unref(cmd);
+    return NULL;
+}
+
+// Run the pipeline in token[] and return its exit status
+int run_pipeline(struct command *entry)
+{
+    // A lone builtin runs right here in the shell, anything else (even a
+    // builtin in a pipeline or in the background) gets its own processes.
+    // So does parallel with job control, it has to be something ^Z can stop
+    if (stage_count > 1 || background || !is_builtin(token[0]) ||
+        (JOB_CONTROL && !strcmp(token[0], "parallel")))
+    {
+        // A job that got stopped counts as having been stopped by ^Z
+        int status = run_external(entry);
+        if (background)
+            return 0;
+        return status == -1 ? 128 + SIGTSTP : exit_code(status);
+    }
+
+    // Its redirections are the shell's for as long as it runs. Output we
+    // buffered before then is not for them
+    fflush(stdout);
+    long long t = TRACE_BEGIN();
+    int status = 1;
+    if (redirect_apply(redirs, redir_count, true))
+        status = run_builtin(token);
+    fflush(stdout);
+    redirect_restore(redirs, redir_count);
+    TRACE_END("builtin", t);
+
+    // Builtins run in the shell, so all there is to measure is time
+    entry->status = W_EXITCODE(status & 0xff, 0);
+    entry->wall_us = now_us() - entry->start_us;
+    return status & 0xff;
+}
+
+// `exit` and `quit` end the shell with the status they are given, or
+// with the last command's. Anything but a number is status 2
+void exit_with(char **argv)
+{
+    if (argv[1] == NULL)
+        return;
+
+    char *end;
+    errno = 0;
+    long n = strtol(argv[1], &end, 10);
+    if (errno || end == argv[1] || *end != '\0')
+    {
+        fprintf(stderr, "msh: %s: %s: numeric argument required\n", argv[0], argv[1]);
+        last_status = 2;
+        return;
+    }
+    last_status = n & 0xff;
+}
+
+// Run the pipelines parse_line split the line into, for `entry`
+void run_list(struct command *entry)
+{
+    for (size_t i = 0; i < list_count; ++i)
+    {
+        // && and || go by how the last pipeline that ran did
+        if (i > 0 && ((list[i - 1].op == op_and && last_status != 0) ||
+                      (list[i - 1].op == op_or && last_status == 0)))
+            continue;
+
+        // A syntax error stops the line, a pipeline with nothing left in
+        // it after expansion is just skipped
+        if (!parse_pipeline(i))
+        {
+            last_status = 2;
+            break;
+        }
+        if (token[0] == NULL)
+            continue;
+
+        if (stage_count == 1 && !background &&
+            (!strcmp(token[0], "quit") || !strcmp(token[0], "exit")))
+        {
+            exit_with(token);
+            exit_requested = true;
+            break;
+        }
+
+        last_status = run_pipeline(entry);
+    }
+}
+
+// Runs the line that was just parsed. `cmd` is its text, and the reference
+// to it is handed over to the history entry
+void run_command_string(char *cmd)
+{
+    long long trace_start = TRACE_BEGIN();
+    long long t = trace_start;
+
+    /* Add command to the history */
+
+    hist_ptr += 1;
+    if (hist_ptr == HISTORY_SIZE)
+        hist_ptr = 0;
+
+    // The slot's old command can be the one we are about to run again, and
+    // then dropping it here only drops the slot's own reference
+    cmd_unref(history[hist_ptr].cmd);
+    history[hist_ptr].cmd = cmd;
+
+    // Do this in case history needs to see its own pid
+    struct command *entry = &history[hist_ptr];
+    free(entry->pids);
+    entry->pids = NULL;
+    entry->npids = 0;
+    entry->seq = ++hist_seq;
+    entry->when = time(NULL);
+    entry->pending = false;
+    entry->status = -1;
+    entry->start_us = now_us();
+    entry->wall_us = entry->user_us = entry->sys_us = 0;
+    entry->maxrss_kb = 0;
+    TRACE_END("history", t);
+
+    run_list(entry);
+
+    // Background jobs write their own record once they are done
+    if (!entry->pending)
+    {
+        t = TRACE_BEGIN();
+        histlog_append(entry);
+        TRACE_END("histlog", t);
+    }
+
+    TRACE_END_ARG("command", trace_start, -1, cmd);
+}
+
+
+/*
+ * Command substitution
+ *
+ * `$(command)` is run while its word is being parsed. Output is read back
+ * with big reads into a buffer that grows to fit. There are three ways to
+ * run the command, cheapest first:
+ *
+ *   - A plain builtin that only prints something, `$(pwd)`, runs right here
+ *     in the shell with its stdout on a memfd. No fork at all
+ *   - A plain external command is started with start_stage like any other
+ *     stage, with its stdout on a pipe
+ *   - Anything else, with quotes, operators, expansions or a builtin that
+ *     could change the shell, gets a forked subshell that runs it as a line
+ *     of its own, so it can't change anything in ours
+ *
+ * Plain means nothing but words, no quoting, variables, globs or operators.
+ * Either way `$?` is the command's exit status afterwards.
+ */
+#define SUBST_READ_SIZE 65536
+
+// Builtins that don't touch the shell, so running them in it is the same as
+// running them in a subshell
+const char *const subst_builtins[] = {"dirs", "echo", "false", "history", "jobs", "pwd", "test", "true"};
+
+bool subst_in_shell(const char *name)
+{
+    for (size_t i = 0; i < sizeof(subst_builtins) / sizeof(*subst_builtins); ++i)
+    {
+        if (!strcmp(name, subst_builtins[i]))
+            return true;
+    }
+    return false;
+}
+
+// Everything left to read from `fd`, into `out`
+bool subst_read(int fd, struct word_buf *out)
+{
+    out->len = 0;
+    while (1)
+    {
+        if (out->cap - out->len < SUBST_READ_SIZE)
+        {
+            size_t cap = out->cap ? out->cap * 2 : 2 * SUBST_READ_SIZE;
+            char *buf = realloc(out->buf, cap);
+            if (buf == NULL)
+            {
+                fputs("msh: out of memory\n", stderr);
+                return false;
+            }
+            out->buf = buf;
+            out->cap = cap;
+        }
+
+        ssize_t n = read(fd, out->buf + out->len, out->cap - out->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return true;
+        out->len += n;
+    }
+}
+
+// Split a plain command into an argv in the line arena. NULL if it isn't
+// plain, or on no memory
+char **subst_argv(char *cmd)
+{
+    if (strpbrk(cmd, "'\"\\$`|&;<>(){}*?[]~#\n") != NULL)
+        return NULL;
+
+    size_t n = 0;
+    for (char *p = cmd + strspn(cmd, WHITESPACE); *p != '\0'; p += strspn(p, WHITESPACE))
+    {
+        n++;
+        p += strcspn(p, WHITESPACE);
+    }
+
+    char **argv = arena_alloc(&line_arena, (n + 1) * sizeof(*argv));
+    if (argv == NULL)
+        return NULL;
+
+    n = 0;
+    for (char *p = cmd + strspn(cmd, WHITESPACE); *p != '\0'; p += strspn(p, WHITESPACE))
+    {
+        argv[n++] = p;
+        p += strcspn(p, WHITESPACE);
+        if (*p != '\0')
+            *p++ = '\0';
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+// A builtin, with its stdout on a memfd for as long as it runs
+bool subst_builtin(char **argv, struct word_buf *out)
+{
+    int fd = memfd_create("msh-subst", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("msh: memfd_create");
+        return false;
+    }
+
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDOUT_FILENO);
+    last_status = run_builtin(argv) & 0xff;
+    fflush(stdout);
+    if (saved != -1)
+    {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    else
+        close(STDOUT_FILENO);
+
+    bool ok = lseek(fd, 0, SEEK_SET) == 0 && subst_read(fd, out);
+    close(fd);
+    return ok;
+}
+
+// A forked copy of the shell runs the command as a line. Whatever it does
+// to its cwd, variables or jobs stays in there
+pid_t subst_subshell(const char *cmd, int out)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    // Not a shell anyone types at, and its input is not ours to read. It is
+    // still in our process group, and so is everything it starts without job
+    // control, so the stop signals stay ignored in all of them
+    if (JOB_CONTROL)
+        default_job_signals(&own_group_sigset);
+    job_control = false;
+    interactive = false;
+    input.fd = -1;
+    input.start = input.end = 0;
+    input.eof = true;
+
+    // parse_tokens reuses the arena the command is in
+    char *line = strdup(cmd);
+    struct command entry = {.cmd = line, .status = -1};
+    if (line == NULL)
+        _exit(1);
+    if (parse_line(line))
+        run_list(&entry);
+    else
+        last_status = 2;
+    fflush(stdout);
+    _exit(last_status);
+}
+
+bool substitute(char *cmd, struct word_buf *out)
+{
+    long long t = TRACE_BEGIN();
+    out->len = 0;
+
+    char **argv = subst_argv(cmd);
+    if (argv != NULL && argv[0] == NULL)
+        return true;
+    if (argv != NULL && subst_in_shell(argv[0]))
+    {
+        bool ok = subst_builtin(argv, out);
+        TRACE_END_ARG("subst", t, -1, argv[0]);
+        return ok;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    reader_release_stdin();
+    pid_t pid;
+    if (argv != NULL && !is_builtin(argv[0]) && strcmp(argv[0], "exit") && strcmp(argv[0], "quit"))
+        pid = start_stage(argv, -1, fds[1], NULL, 0);
+    else if ((pid = subst_subshell(cmd, fds[1])) == -1)
+        perror("fork");
+    close(fds[1]);
+
+    if (pid == -1)
+    {
+        close(fds[0]);
+        last_status = argv != NULL ? start_failure : 1;
+        return true;
+    }
+
+    bool ok = subst_read(fds[0], out);
+    close(fds[0]);
+
+    int status = W_EXITCODE(1, 0);
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    last_status = exit_code(status);
+    TRACE_END_ARG("subst", t, pid, cmd);
+
+    // ^C gives up on the whole line, not just on this command
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+    {
+        if (interactive)
+            putchar('\n');
+        return false;
+    }
+    return ok;
+}
+
+char *pwd()
+{
+    char *dir = getcwd(NULL, 0);
+
+    if (dir == NULL)
+    {
+        perror("Failed to get the current working directory");
+        return NULL;
+    }
+
+    return dir;
+}
+
+void get_home_and_uname(char **home, char **uname)
+{
+    // Only the prompt wants these. Leaving getpwuid out altogether also
+    // keeps static builds from dragging in NSS
+    if (!MSH_FEATURE_PROMPT)
+    {
+        *home = "";
+        *uname = "user";
+        return;
+    }
+
+    errno = 0;
+    struct passwd *pwd = getpwuid(getuid());
+
+    if (pwd == NULL)
+    {
+        if (!errno)
+        {
+            // You don't exist for some reason
+            *home = "";
+            *uname = "user";
+        }
+        else
+        {
+            do
+            {
+                errno = 0;
+                pwd = getpwuid(getuid());
+        
+          // These types of errors might take a while to fix and I cannot wait
+            } while (pwd == NULL && errno != EIO && errno != ENOMEM);
+
+            if (pwd == NULL)
+            {
+                *home = "<error>";
+                *uname = "<error>";
+
+                perror("A fatal error occurred");
+            }
+        }
+    }
+
+   if (pwd != NULL)
+   {
+        *home = pwd->pw_dir;
+        *uname = pwd->pw_name;
+   }    
+}
+
+/*
+ * Prompt state
+ *
+ * The user name, home directory and host name can't change under us, so they
+ * are looked up once at startup (getpwuid can go all the way out to LDAP).
+ * The working directory only changes when our own cd succeeds, so that is
+ * the only time the prompt gets rebuilt. Printing it is just a fputs.
+ */
+void init_prompt()
+{
+    char *home, *uname;
+    get_home_and_uname(&home, &uname);
+
+    // getpwuid hands back static storage, keep our own copies
+    prompt.home = strdup(home);
+    prompt.uname = strdup(uname);
+
+    if (gethostname(prompt.hname, HOST_NAME_MAX) < 0)
+    {
+        *prompt.hname = '\0';
+    }
+    prompt.hname[HOST_NAME_MAX] = '\0';
+
+    refresh_prompt();
+}
+
+// Rebuild the prompt for the current working directory
+void refresh_prompt()
+{
+    // Nothing to refresh if the prompt is never shown
+    if (prompt.uname == NULL)
+        return;
+
+    long long t = TRACE_BEGIN();
 
-#define MAX_NUM_ARGUMENTS 10 // Mav shell only supports four arguments
+    const char *wd = cwd.path ? cwd.path : "<nowhere>";
 
-#define HISTORY_SIZE 15
+    // Only shorten to ~ when home is a whole leading component, so /rootx is
+    // not mistaken for being inside /root
+    const char *rest = NULL;
+    size_t n = strlen(prompt.home);
+    if (n > 0 && !strncmp(prompt.home, wd, n) && (wd[n] == '/' || wd[n] == '\0'))
+        rest = wd + n;
 
-char *token[MAX_NUM_ARGUMENTS + 1];
+    size_t len = strlen(prompt.uname) + 1 + strlen(prompt.hname) + 1 +
+                 (rest ? 1 + strlen(rest) : strlen(wd)) + 3;
+    if (len > prompt.cap)
+    {
+        char *buf = realloc(prompt.buf, len);
+        if (buf == NULL)
+            return;
+        prompt.buf = buf;
+        prompt.cap = len;
+    }
 
-// Points to the most recent command in history. Starts off as -1
-int hist_ptr = -1;
+    char *p = prompt.buf;
+    p = stpcpy(p, prompt.uname);
 
-struct command
+    if (*prompt.hname != '\0')
+    {
+        *p++ = '@';
+        p = stpcpy(p, prompt.hname);
+    }
+
+    *p++ = ':';
+    if (rest)
+    {
+        *p++ = '~';
+        p = stpcpy(p, rest);
+    }
+    else
+    {
+        p = stpcpy(p, wd);
+    }
+
+    *p++ = strcmp(prompt.uname, "root") ? '$' : '#';
+    *p++ = ' ';
+    *p = '\0';
+
+    TRACE_END("prompt", t);
+}
+
+const char *get_prompt()
 {
-    char *cmd;
+    // The msh prompt for the class, and for builds that don't bother
+    if (!MSH_FEATURE_PROMPT)
+        return "msh> ";
+    return prompt.buf ? prompt.buf : "";
+}
+
+/*
+ * Server mode
+ *
+ * `msh --serve path.sock` keeps one shell resident for callers that would
+ * otherwise start a new one for every task. Each connection gets a worker
+ * forked off the server, so the environment is already set up, and the
+ * worker keeps its own cwd, variables and jobs for as long as the client
+ * stays connected. The worker reads newline separated commands straight off
+ * the socket and runs them like a script. Its stdout and stderr come back
+ * to the server over pipes, and the server frames them onto the socket:
+ *
+ *     out <len>\n<len bytes>
+ *     err <len>\n<len bytes>
+ *     done <status> <real_us> <user_us> <sys_us>\n
+ *
+ * with a done after every line, once all of that line's output is out.
+ * Everything goes through one epoll loop, so a slow client only ever holds
+ * up its own worker. With MSH_TRACE every worker writes its own trace, with
+ * its pid tacked on to the file name.
+ */
+
+#define SERVE_BACKLOG 64
+#define SERVE_READ_SIZE 65536
+#define SERVE_HIGH_WATER (4 * SERVE_READ_SIZE) // Stop reading a worker's pipes past this
+
+enum serve_fd_kind
+{
+    SERVE_OUT,
+    SERVE_ERR,
+    SERVE_STATUS,
+    SERVE_SOCK,
+};
+
+struct serve_client
+{
+    int sock;           // -1 when the slot is free
     pid_t pid;
+    int fds[3];         // Read ends of the worker's stdout and stderr, and
+                        // its status socket. -1 once closed
+    char *buf;          // Frames not yet sent
+    size_t len, sent, cap;
+    char status[128];   // Partial done record
+    size_t status_len;
+    bool paused;        // Not reading from the worker
+    bool writing;       // Waiting for the socket to take more
+    bool broken;        // Client went away, just drain the worker
 };
 
-// Zero-initialized
-struct command history[HISTORY_SIZE] = {0};
+struct serve_client *serve_clients = NULL;
+size_t serve_clients_cap = 0;
+int serve_epoll = -1;
+int serve_listen = -1;
+volatile sig_atomic_t serve_stop = 0;
 
-void free_array(char **arr, size_t size)
+// In a worker, where the done records go
+struct serve_worker
 {
-    for (size_t i = 0; i < size; ++i)
-    {
-        if (arr[i] != NULL)
-        {
-            free(arr[i]);
-        }
-    }
+    int status_fd;
+    long long start_us;
+    long long cpu_us[2];
+} serve_worker = {-1, 0, {0, 0}};
+
+void on_serve_stop(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
 }
 
-/* Parse input*/
-void parse_tokens(const char *command_string)
+// User and system time of the worker and everything it waited for
+void serve_cpu(long long cpu_us[2])
 {
-    // Clean up the old values in token
-    free_array(token, MAX_NUM_ARGUMENTS);
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    cpu_us[0] = timeval_us(self.ru_utime) + timeval_us(children.ru_utime);
+    cpu_us[1] = timeval_us(self.ru_stime) + timeval_us(children.ru_stime);
+}
+
+void serve_begin()
+{
+    serve_worker.start_us = now_us();
+    serve_cpu(serve_worker.cpu_us);
+}
 
-    int token_count = 0;
-    // Pointer to point to the token parsed by strsep
-    char *argument_ptr = NULL;
+// Tell the server the line is done. It answers once it has sent everything
+// the line wrote, so that the next line's output can't overtake this one
+void serve_done()
+{
+    long long cpu_us[2];
+    serve_cpu(cpu_us);
+    fflush(stdout);
+    fflush(stderr);
 
-    char *working_string = strdup(command_string);
+    char rec[128];
+    int n = snprintf(rec, sizeof(rec), "done %d %lld %lld %lld\n", last_status,
+                     now_us() - serve_worker.start_us, cpu_us[0] - serve_worker.cpu_us[0],
+                     cpu_us[1] - serve_worker.cpu_us[1]);
+    serve_worker.start_us = 0;
+    char ack;
+    if (send(serve_worker.status_fd, rec, n, MSG_NOSIGNAL) != n ||
+        TEMP_FAILURE_RETRY(read(serve_worker.status_fd, &ack, 1)) != 1)
+        exit(EXIT_FAILURE); // The server is gone, and so is our client
+}
 
-    // we are going to move the working_string pointer so
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *head_ptr = working_string;
+void serve_watch(struct serve_client *c, int kind, int op, uint32_t events)
+{
+    int fd = kind == SERVE_SOCK ? c->sock : c->fds[kind];
+    struct epoll_event ev = {.events = events};
+    ev.data.u64 = (uint64_t)(c - serve_clients) << 2 | kind;
+    epoll_ctl(serve_epoll, op, fd, &ev);
+}
 
-    // Tokenize the input strings with whitespace used as the delimiter
-    while (((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
-           (token_count < MAX_NUM_ARGUMENTS))
+// Stop reading from the worker while the client is behind, and start again
+// once it has caught up
+void serve_throttle(struct serve_client *c)
+{
+    bool pause = c->len - c->sent > SERVE_HIGH_WATER;
+    if (pause == c->paused)
+        return;
+    c->paused = pause;
+    for (int k = SERVE_OUT; k <= SERVE_STATUS; ++k)
     {
-        token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
-        if (strlen(token[token_count]) == 0)
-        {
-            free(token[token_count]);
-            token[token_count] = NULL;
-        }
-        token_count++;
+        if (c->fds[k] != -1)
+            serve_watch(c, k, EPOLL_CTL_MOD, pause ? 0 : EPOLLIN);
+    }
+}
+
+bool serve_append(struct serve_client *c, const char *s, size_t n)
+{
+    if (c->broken)
+        return true;
+    if (c->sent == c->len)
+        c->sent = c->len = 0;
+    if (c->len + n > c->cap)
+    {
+        size_t cap = c->cap ? c->cap : SERVE_READ_SIZE;
+        while (cap < c->len + n)
+            cap *= 2;
+        char *buf = realloc(c->buf, cap);
+        if (buf == NULL)
+            return false;
+        c->buf = buf;
+        c->cap = cap;
     }
+    memcpy(c->buf + c->len, s, n);
+    c->len += n;
+    return true;
+}
 
-    // Set all args from the last arg parsed to the end of the token array
-    // This helps so that I don't get a double free error if I run a cmd that
-    // has 7 args then run one that has 3 args then called free_array on token
-    for (; token_count < MAX_NUM_ARGUMENTS; ++token_count)
+// Write out as much as the client will take right now
+void serve_flush(struct serve_client *c)
+{
+    while (!c->broken && c->sent < c->len)
     {
-        token[token_count] = NULL;
-    }    
+        ssize_t n = send(c->sock, c->buf + c->sent, c->len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            c->broken = true;
+        else
+            c->sent += n;
+    }
+    if (c->broken)
+        c->sent = c->len = 0;
 
-    free(head_ptr);
+    bool writing = c->sent < c->len;
+    if (writing != c->writing)
+        serve_watch(c, SERVE_SOCK, EPOLL_CTL_MOD, writing ? EPOLLOUT : 0);
+    c->writing = writing;
+    serve_throttle(c);
 }
 
-// Returns the pid of the child process that was spawned
-pid_t run_external()
+void serve_close_fd(struct serve_client *c, int kind)
 {
-    pid_t pid = fork();
+    close(c->fds[kind]);
+    c->fds[kind] = -1;
+}
 
-    if (pid == -1)
+// One read from the worker's stdout or stderr, framed. False at end of file
+bool serve_pipe(struct serve_client *c, int kind)
+{
+    char data[SERVE_READ_SIZE];
+    ssize_t n = read(c->fds[kind], data, sizeof(data));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return true;
+    if (n <= 0)
     {
-        // We can't really do anything but exit
-        perror("fork: fatal error");
-        exit(EXIT_FAILURE);
+        serve_close_fd(c, kind);
+        return false;
     }
-    if (pid == 0)
-    {
-        execvp(token[0], token);
 
-        /* Execution will get here only if failed */
+    char head[32];
+    int h = snprintf(head, sizeof(head), "%s %zd\n", kind == SERVE_OUT ? "out" : "err", n);
+    if (!serve_append(c, head, h) || !serve_append(c, data, n))
+    {
+        fputs("msh: out of memory\n", stderr);
+        c->broken = true;
+    }
+    return true;
+}
 
-        // If command not found, print that, else print the specific error
-        if (errno == ENOENT)
-            fprintf(stderr, "%s: Command not found.\n", token[0]);
-        else
-            perror(token[0]);
+void serve_status(struct serve_client *c)
+{
+    ssize_t n = read(c->fds[SERVE_STATUS], c->status + c->status_len,
+                     sizeof(c->status) - c->status_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (n <= 0)
+    {
+        serve_close_fd(c, SERVE_STATUS);
+        return;
+    }
+    c->status_len += n;
 
-        // If you don't exit you will basically have two shells now lol
-        exit(EXIT_FAILURE);
+    char *nl = memchr(c->status, '\n', c->status_len);
+    if (nl == NULL)
+    {
+        if (c->status_len == sizeof(c->status))
+            c->status_len = 0; // Not from any worker of ours
+        return;
     }
-    else
+
+    // The worker has written everything for this line and waits for us, so
+    // whatever is in the pipes belongs before the record
+    for (int k = SERVE_OUT; k <= SERVE_ERR; ++k)
     {
-        // You can check the status of the child here for some fancy stuff
-        int status;
-        waitpid(pid, &status, 0);
+        while (c->fds[k] != -1)
+        {
+            int avail = 0;
+            if (ioctl(c->fds[k], FIONREAD, &avail) == -1 || avail == 0)
+                break;
+            serve_pipe(c, k);
+        }
     }
 
-    //return the pid
-    return pid;
+    size_t len = nl + 1 - c->status;
+    serve_append(c, c->status, len);
+    memmove(c->status, nl + 1, c->status_len - len);
+    c->status_len -= len;
+    send(c->fds[SERVE_STATUS], "", 1, MSG_NOSIGNAL);
 }
 
-void print_history(bool showpid)
+void serve_release(struct serve_client *c)
 {
-    // Choose to showpid or not
-    if (showpid)
+    for (int k = SERVE_OUT; k <= SERVE_STATUS; ++k)
     {
-        // If the pointer is at the last element in the list or the list
-        // isn't full yet, print the history from the first element to the
-        // current one pointed by `hist_ptr`
-        if (hist_ptr == HISTORY_SIZE - 1 || history[hist_ptr + 1].cmd == NULL)
-        {
-            for (int i = 0; i <= hist_ptr; ++i)
-                printf("[%2d] [%d] %s", i, history[i].pid, history[i].cmd);
-        }
-        // else, we print the history from the current one, then loop around
-        // the list
-        else
-        {
-            for (int i = hist_ptr + 1, j = 0; j < HISTORY_SIZE; ++i, ++j)
-            {
-                if (i == HISTORY_SIZE)
-                    i = 0;
-                printf("[%2d] [%d] %s", j, history[i].pid, history[i].cmd);
-            }
-        }
+        if (c->fds[k] != -1)
+            serve_close_fd(c, k);
     }
-    else
+    close(c->sock);
+    c->sock = -1;
+    free(c->buf);
+    c->buf = NULL;
+    c->len = c->sent = c->cap = c->status_len = 0;
+    c->paused = c->writing = c->broken = false;
+}
+
+// Set up as the connection's worker in a freshly forked child
+void serve_become_worker(struct serve_client *c, int out, int err, int status)
+{
+    int sock = c->sock;
+    for (size_t i = 0; i < serve_clients_cap; ++i)
     {
-        // Same logic as above
-        if (hist_ptr == HISTORY_SIZE - 1 || history[hist_ptr + 1].cmd == NULL)
-        {
-            for (int i = 0; i <= hist_ptr; ++i)
-                printf("[%2d] %s", i, history[i].cmd);
-        }
+        struct serve_client *other = &serve_clients[i];
+        if (other != c && other->sock != -1)
+            serve_release(other);
+    }
+    close(serve_listen);
+    close(serve_epoll);
+    free(serve_clients);
+    serve_clients = NULL;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    // Commands get nothing on stdin, the socket is for us
+    int null = open("/dev/null", O_RDONLY);
+    if (null == -1 || dup2(null, STDIN_FILENO) == -1 ||
+        dup2(out, STDOUT_FILENO) == -1 || dup2(err, STDERR_FILENO) == -1)
+        exit(EXIT_FAILURE);
+    close(null);
+    close(out);
+    close(err);
+
+    // Every worker would write its trace over the same file at exit, so
+    // each one gets its own, named after its pid, and starts out empty
+    if (trace.enabled)
+    {
+        char *path;
+        if (asprintf(&path, "%s.%d", trace.path, (int)getpid()) == -1)
+            trace.enabled = false;
         else
         {
-            for (int i = hist_ptr + 1, j = 0; j < HISTORY_SIZE; ++i, ++j)
-            {
-                if (i == HISTORY_SIZE)
-                    i = 0;
-                printf("[%2d] %s", j, history[i].cmd);
-            }
+            free(trace.path);
+            trace.path = path;
         }
+        trace.next = 0;
     }
+
+    serve_worker.status_fd = status;
+    reader_open_fd(&input, sock);
 }
 
-void run_command_string(char *command_string)
+void serve_accept()
 {
-    char *cmd = token[0];
+    int sock = accept4(serve_listen, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1)
+        return;
 
-    if (*cmd == '!')
-        if (*(cmd + 1) == '!')
+    struct serve_client *c = NULL;
+    for (size_t i = 0; i < serve_clients_cap && c == NULL; ++i)
+    {
+        if (serve_clients[i].sock == -1)
+            c = &serve_clients[i];
+    }
+    if (c == NULL)
+    {
+        size_t cap = serve_clients_cap ? serve_clients_cap * 2 : 16;
+        struct serve_client *clients = realloc(serve_clients, cap * sizeof(*clients));
+        if (clients == NULL)
         {
-            if (hist_ptr == -1)
-                puts("Command not in history");
-            else
-            {
-                // Run the most recent command
-                parse_tokens(history[hist_ptr].cmd);
-                run_command_string(history[hist_ptr].cmd);
-            }
+            close(sock);
+            return;
         }
-        else
-        {
-            if (*(cmd + 1) == '\0') return; //ignore '!'
-            
-            char *endp;
-            unsigned long hist = strtoul(cmd + 1, &endp, 10);
-
-            // If something that is not a digit is found, or `n` is out of
-            // bounds, that is an invalid command and we report this
-            if (*endp != '\0' || hist >= HISTORY_SIZE)
-            {
-                fprintf(stderr, "Invalid reference: %s\n", cmd + 1);
-                return;
-            }
-
-            /* Do some math to calculate the real index */
-
-            // hist_ptr always points to the end of the list so hist_ptr + 1 is
-            // actually the first command in history. Offset that number by
-            // hist and we got our real history index.
-            // **NOTE** we don't need to do that if hist_ptr points to the
-            // bottom of the history array or the history array has less than
-            // HISTORY_SIZE elements
-            if (hist_ptr != HISTORY_SIZE - 1 && history[hist_ptr + 1].cmd != NULL)
-            {
-                hist = hist + hist_ptr + 1;
+        for (size_t i = serve_clients_cap; i < cap; ++i)
+            clients[i] = (struct serve_client){.sock = -1};
+        c = &clients[serve_clients_cap];
+        serve_clients = clients;
+        serve_clients_cap = cap;
+    }
 
-                if (hist >= HISTORY_SIZE)
-                    hist -= HISTORY_SIZE;
-            }
-            
-            if (history[hist].cmd == NULL)
-                fputs("Command not in history\n", stderr);
-            else
-            {
-                // Run the command at the specified history number
-                parse_tokens(history[hist].cmd);
-                run_command_string(history[hist].cmd);
-            }
-        }
-    else
+    int out[2], err[2], status[2];
+    if (pipe2(out, O_CLOEXEC) == -1)
+    {
+        close(sock);
+        return;
+    }
+    if (pipe2(err, O_CLOEXEC) == -1)
     {
-        /* Add command to the history if it is not a `!` command */
+        close(out[0]);
+        close(out[1]);
+        close(sock);
+        return;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, status) == -1)
+    {
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        close(sock);
+        return;
+    }
 
-        hist_ptr += 1;
-        if (hist_ptr == HISTORY_SIZE)
-            hist_ptr = 0;
+    *c = (struct serve_client){.sock = sock, .fds = {out[0], err[0], status[0]}};
+    c->pid = fork();
+    if (c->pid == 0)
+    {
+        close(out[0]);
+        close(err[0]);
+        close(status[0]);
+        serve_become_worker(c, out[1], err[1], status[1]);
+        return;
+    }
+    close(out[1]);
+    close(err[1]);
+    close(status[1]);
 
-        // Save the previous cmd so we can delete it later. We can't delete it
-        // now because it might be the same string pointed to by command_string
-        char *prev = history[hist_ptr].cmd;
+    if (c->pid == -1)
+    {
+        perror("msh: fork");
+        serve_release(c);
+        return;
+    }
 
-        history[hist_ptr].cmd = strdup(command_string);
+    for (int k = SERVE_OUT; k <= SERVE_STATUS; ++k)
+    {
+        fcntl(c->fds[k], F_SETFL, O_NONBLOCK);
+        serve_watch(c, k, EPOLL_CTL_ADD, EPOLLIN);
+    }
+    serve_watch(c, SERVE_SOCK, EPOLL_CTL_ADD, 0);
+}
 
-        // Do this in case history needs to see its own pid
-        history[hist_ptr].pid = -1;
+// A socket left behind by a server that is gone can be taken over, one
+// with a live server on it can't
+bool serve_stale(const struct sockaddr_un *addr)
+{
+    struct stat st;
+    if (lstat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode))
+        return false;
 
-        // We have wrapped around so we free the history that used to be here
-        if (prev != NULL)
-            free(prev);
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1)
+        return false;
+    bool stale = connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) == -1 &&
+                 errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
 
-        if (!strcmp(cmd, "history"))
-        {
-            // Print the history, pass if you want to show the pids or not
-            print_history(token[1] != NULL && !strcmp(token[1], "-p"));
-        }
-        else if (!strcmp(cmd, "cd"))
-        {
-            if (token[2] != NULL)
-            {
-                fprintf(stderr, "Too many args for cd command\n");
-                return;
-            }
+bool serve_bind(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "msh: %s: socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
 
-            char *dir = token[1];
-            if (dir == NULL)
-            {
-                // Try to cd to the user's home directory. We do this through
-                // the environment variable "HOME"
-                // There is a better way to get home directory but if some major
-                // shells use this, who am I to not do the same
-                dir = getenv("HOME");
-            }
+    serve_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serve_listen == -1)
+    {
+        perror("msh: socket");
+        return false;
+    }
 
-            int err = chdir(dir);
-            if (err == -1)
-                fprintf(stderr, "cd: %s\n", strerror(errno));
-        }
-        else
-        {
-            history[hist_ptr].pid = run_external();
-        }
+    int r = bind(serve_listen, (struct sockaddr *)&addr, sizeof(addr));
+    if (r == -1 && errno == EADDRINUSE && serve_stale(&addr))
+    {
+        unlink(path);
+        r = bind(serve_listen, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (r == -1 || listen(serve_listen, SERVE_BACKLOG) == -1)
+    {
+        fprintf(stderr, "msh: %s: %s\n", path, strerror(errno));
+        return false;
     }
+    return true;
 }
 
-char *pwd()
+// Runs the server until SIGINT or SIGTERM. Only ever returns in a worker,
+// which then goes on to run its client's commands
+void serve(const char *path)
 {
-    char *dir = getcwd(NULL, 0);
+    if (!serve_bind(path))
+        exit(EXIT_FAILURE);
 
-    if (dir == NULL)
+    serve_epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = UINT64_MAX};
+    if (serve_epoll == -1 || epoll_ctl(serve_epoll, EPOLL_CTL_ADD, serve_listen, &ev) == -1)
     {
-        perror("Failed to get the current working directory");
-        return NULL;
+        perror("msh: epoll");
+        unlink(path);
+        exit(EXIT_FAILURE);
     }
 
-    return dir;
-}
-
-void get_home_and_uname(char **home, char **uname)
-{
-    errno = 0;
-    struct passwd *pwd = getpwuid(getuid());
+    // No SA_RESTART, so that epoll_wait gives up
+    struct sigaction sa = {0};
+    sa.sa_handler = on_serve_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-    if (pwd == NULL)
+    while (!serve_stop)
     {
-        if (!errno)
-        {
-            // You don't exist for some reason
-            *home = "";
-            *uname = "user";
-        }
-        else
+        struct epoll_event events[64];
+        int n = epoll_wait(serve_epoll, events, 64, -1);
+        for (int i = 0; i < n; ++i)
         {
-            do
+            if (events[i].data.u64 == UINT64_MAX)
             {
-                errno = 0;
-                pwd = getpwuid(getuid());
-        
-          // These types of errors might take a while to fix and I cannot wait
-            } while (pwd == NULL && errno != EIO && errno != ENOMEM);
+                serve_accept();
+                if (serve_worker.status_fd != -1)
+                    return;
+                continue;
+            }
 
-            if (pwd == NULL)
-            {
-                *home = "<error>";
-                *uname = "<error>";
+            // A slot freed earlier in this batch can still have events here
+            struct serve_client *c = &serve_clients[events[i].data.u64 >> 2];
+            int kind = events[i].data.u64 & 3;
+            if (c->sock == -1)
+                continue;
 
-                perror("A fatal error occurred");
+            if (kind == SERVE_SOCK)
+            {
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    c->broken = true;
+            }
+            else if (c->fds[kind] != -1)
+            {
+                if (kind == SERVE_STATUS)
+                    serve_status(c);
+                else
+                    serve_pipe(c, kind);
             }
+            serve_flush(c);
+
+            if (c->fds[SERVE_OUT] == -1 && c->fds[SERVE_ERR] == -1 &&
+                c->fds[SERVE_STATUS] == -1 && c->sent == c->len)
+                serve_release(c);
         }
+
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
     }
 
-   if (pwd != NULL)
-   {
-        *home = pwd->pw_dir;
-        *uname = pwd->pw_name;
-   }    
+    unlink(path);
+    exit(EXIT_SUCCESS);
 }
 
-char *get_prompt()
+void usage()
 {
-    char *wd = pwd();
+    fputs("usage: msh [-c command | --serve socket | script]\n", stderr);
+    exit(2);
+}
 
-    if (wd == NULL)
-        wd = "<nowhere>";
+int main(int argc, char **argv)
+{
+    init_trace();
+    init_env();
+    init_cwd();
 
-    char *home, *uname;
-    get_home_and_uname(&home, &uname);
-    
-    int n = strlen(home);
-    if (!strncmp(home, wd, n))
+    // Figure out where commands come from. Only a terminal on stdin gets a
+    // prompt, everything else is a script and is run quietly
+    if (argc > 1 && !strcmp(argv[1], "-c"))
     {
-        *wd = '~';
-        memmove(wd + 1, wd + n, strlen(wd) - n + 1);
+        if (argc < 3)
+            usage();
+        reader_open_string(&input, argv[2]);
     }
-
-    char hname[HOST_NAME_MAX + 1];
-    if (gethostname(hname, HOST_NAME_MAX) < 0)
+    else if (argc > 1 && !strcmp(argv[1], "--serve"))
     {
-        *hname = '\0';
+        if (argc < 3)
+            usage();
+        serve(argv[2]);
     }
-
-    char *everything = malloc(strlen(uname) + 1 + strlen(hname) + 1 + strlen(wd) + 2);
-
-    n = 0;
-    strcpy(everything + n, uname);
-    n += strlen(uname);
-
-    if (*hname != '\0')
+    else if (argc > 1)
     {
-        everything[n++] = '@';
-        strcpy(everything + n, hname);
-        n += strlen(hname);
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fprintf(stderr, "msh: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        reader_open_fd(&input, fd);
+        init_plan(fd);
+    }
+    else
+    {
+        reader_open_fd(&input, STDIN_FILENO);
+        interactive = isatty(STDIN_FILENO);
     }
 
-    everything[n++] = ':';
-    strcpy(everything + n, wd);
-    n += strlen(wd);
-
-    everything[n++] = strcmp(uname, "root") ? '$' : '#';
-    everything[n] = '\0';
-
-    free(wd);
-    return everything;
-}
+    if (MSH_FEATURE_PROMPT && interactive)
+        init_prompt();
+    init_history_log();
 
-int main()
-{
-    char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
+    init_jobs();
+    editor_init();
 
     while (1)
     {
-#ifdef SCHOOL_MODE
-        // Print out the msh prompt for the class, else print regular shell prompt
-        printf("msh> ");
-#else
-        printf("%s ", get_prompt());
-#endif
+        // A --serve client hears how its last line went before we wait for
+        // the next one
+        if (serve_worker.start_us != 0)
+            serve_done();
 
-        // Read the command from the commandline.  The
-        // maximum command that will be read is MAX_COMMAND_SIZE
-        // This while command will wait here until the user
-        // inputs something since fgets returns NULL when there
-        // is no input
-        while (!fgets(command_string, MAX_COMMAND_SIZE, stdin))
-            ;
+        // Tell the user about background jobs that finished in the meantime
+        long long t = TRACE_BEGIN();
+        notify_jobs();
+        TRACE_END("notify", t);
+
+        // Read the command from the commandline. This waits here until the
+        // user inputs something, and end of input is the same as `exit`
+        t = TRACE_BEGIN();
+        char *command_string;
+        if (MSH_FEATURE_EDITOR && editor.enabled)
+        {
+            command_string = editor_getline(get_prompt());
+        }
+        else
+        {
+            if (interactive)
+            {
+                fputs(get_prompt(), stdout);
+                fflush(stdout);
+            }
+            command_string = reader_getline(&input);
+        }
+        TRACE_END("read", t);
+        if (command_string == NULL)
+        {
+            if (interactive)
+                putchar('\n');
+            break;
+        }
+        if (serve_worker.status_fd != -1)
+            serve_begin();
+        const struct plan_line *planned = plan_next_line();
 
-        // Ignore blank lines
-        if (*command_string == '\n')
+        // Swap a history reference for the command it refers to
+        t = TRACE_BEGIN();
+        char *cmd = expand_history(command_string);
+        TRACE_END("expand", t);
+        if (cmd == NULL)
         {
             continue;
         }
 
-        parse_tokens(command_string);
+        // Split the line into its pipelines. Only the first is tokenized
+        // now, the rest are once they are about to run
+        t = TRACE_BEGIN();
+        bool parsed = planned != NULL ? plan_use_line(planned, cmd) : parse_line(cmd);
+        TRACE_END("parse", t);
+        bool ok = parsed && list_count > 0 && parse_pipeline(0);
+
+        // A syntax error is status 2, like one further along the line
+        if (!parsed || (list_count > 0 && !ok))
+            last_status = 2;
 
-        const char *cmd = token[0];
+        // Ignore blank lines, including ones that are only whitespace
+        if (!ok || (token[0] == NULL && list_count == 1))
+        {
+            if (cmd != command_string)
+                cmd_unref(cmd);
+            continue;
+        }
 
         // Quit if command is 'quit' or 'exit'
-        if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
+        if (token[0] != NULL && (!strcmp(token[0], "quit") || !strcmp(token[0], "exit")))
         {
+            exit_with(token);
+            if (cmd != command_string)
+                cmd_unref(cmd);
             break;
         }
 
+        // History holds on to the line, so a fresh one gets its own copy.
+        // The pipelines are where they were in it
+        if (cmd == command_string && (cmd = cmd_new(cmd, strlen(cmd))) == NULL)
+        {
+            fputs("msh: out of memory\n", stderr);
+            continue;
+        }
+        list_line = cmd;
+
         // If line is not blank, parse it, and run the parsed command
-        run_command_string(command_string);
+        run_command_string(cmd);
+        if (exit_requested)
+            break;
     }
 
-    free(command_string);
-    free_array(token, MAX_NUM_ARGUMENTS);
+    hangup_stopped_jobs();
+    end_job_control();
+    close_plan();
+    close_trace();
+    close_history_log();
+    free_trigrams();
+    for (size_t i = 0; i < jobs_cap; ++i)
+    {
+        if (jobs[i].id != 0)
+            free_job(&jobs[i]);
+    }
+    free(jobs);
+
+    free(input.buf);
+    free(list);
+    free(scratch_word.buf);
+    free(scratch_pattern.buf);
+    free(glob_path.buf);
+    free_env();
+    editor_free();
+    free(token);
+    arena_free(&line_arena);
+    free(prompt.buf);
+    free(prompt.uname);
+    free(prompt.home);
+    free_cwd();
 
     for (uint i = 0; i < HISTORY_SIZE; ++i)
     {
-        if (history[i].cmd != NULL)
-            free(history[i].cmd);
+        cmd_unref(history[i].cmd);
+        free(history[i].pids);
     }
 
-    return 0;
+    // Like any other command, a script is as good as the last thing it ran
+    return last_status;
 }
\ No newline at end of file